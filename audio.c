@@ -20,10 +20,90 @@ NR5x  $00  $00 $70
 $FF27-$FF2F always read back as $FF
 */
 
-static uint8_t _duty_waveform[] = {
+static const uint8_t _duty_waveform[] = {
     0b00000001, 0b10000001, 0b10000111, 0b01111110
 };
 
+/*
+  Band limited synthesis.
+  The channels only report when their output changes, a change of the mix is
+  added to the output as a band limited step, so the edges do not alias the
+  way box averaging the 2MHz output does. _blep_kernel[p] spreads the step of
+  a change at phase p of an output sample over AUDIO_BLEP_WIDTH samples, each
+  row adds up to exactly 1 << AUDIO_BLEP_SHIFT so the running sum of
+  blep_buffer follows the mix, minus the DC it leaks (see audio_output).
+  The table is precomputed so every instance shares it read-only. Row p is a
+  blackman windowed sinc cut off at 0.9 of the output nyquist frequency,
+  centered AUDIO_BLEP_WIDTH / 2 - 1 + p / AUDIO_BLEP_PHASES samples later,
+  normalized and rounded, with the rounding error added to the largest tap.
+*/
+static const int32_t _blep_kernel[AUDIO_BLEP_PHASES][AUDIO_BLEP_WIDTH] = {
+    /*  0 */ {     18,   -110,    359,   -843,   1561,  -2371,   3025,  29490,
+                 3025,  -2371,   1561,   -843,    359,   -110,     18,      0 },
+    /*  1 */ {     17,   -108,    347,   -795,   1421,  -2025,   2117,  29452,
+                 3974,  -2714,   1693,   -887,    369,   -111,     18,      0 },
+    /*  2 */ {     17,   -105,    332,   -742,   1276,  -1679,   1252,  29332,
+                 4960,  -3051,   1818,   -925,    376,   -110,     17,      0 },
+    /*  3 */ {     16,   -102,    315,   -686,   1128,  -1335,    434,  29131,
+                 5981,  -3378,   1932,   -956,    380,   -109,     17,      0 },
+    /*  4 */ {     16,    -98,    297,   -627,    977,   -997,   -336,  28853,
+                 7031,  -3693,   2036,   -982,    381,   -106,     16,      0 },
+    /*  5 */ {     15,    -93,    277,   -566,    824,   -665,  -1055,  28499,
+                 8106,  -3992,   2127,   -999,    378,   -103,     15,      0 },
+    /*  6 */ {     14,    -87,    256,   -503,    672,   -343,  -1721,  28067,
+                 9203,  -4273,   2204,  -1009,    372,    -97,     13,      0 },
+    /*  7 */ {     13,    -82,    234,   -439,    522,    -34,  -2334,  27565,
+                10317,  -4531,   2266,  -1011,    362,    -91,     11,      0 },
+    /*  8 */ {     12,    -76,    211,   -375,    374,    262,  -2891,  26992,
+                11444,  -4765,   2311,  -1004,    348,    -83,      8,      0 },
+    /*  9 */ {     10,    -69,    188,   -311,    229,    543,  -3394,  26350,
+                12577,  -4970,   2339,   -987,    330,    -73,      6,      0 },
+    /* 10 */ {      9,    -63,    165,   -248,     90,    807,  -3840,  25646,
+                13712,  -5144,   2348,   -962,    308,    -62,      2,      0 },
+    /* 11 */ {      8,    -56,    142,   -186,    -44,   1052,  -4231,  24877,
+                14845,  -5283,   2338,   -926,    282,    -50,     -1,      1 },
+    /* 12 */ {      7,    -50,    119,   -126,   -171,   1277,  -4566,  24057,
+                15970,  -5386,   2307,   -881,    251,    -36,     -5,      1 },
+    /* 13 */ {      6,    -44,     96,    -68,   -291,   1482,  -4846,  23182,
+                17081,  -5448,   2255,   -825,    217,    -21,    -10,      2 },
+    /* 14 */ {      5,    -37,     74,    -12,   -403,   1666,  -5072,  22257,
+                18174,  -5467,   2182,   -760,    178,     -4,    -15,      2 },
+    /* 15 */ {      4,    -31,     53,     41,   -506,   1828,  -5246,  21289,
+                19243,  -5441,   2086,   -685,    136,     14,    -20,      3 },
+    /* 16 */ {      3,    -25,     33,     90,   -600,   1968,  -5368,  20283,
+                20283,  -5368,   1968,   -600,     90,     33,    -25,      3 },
+    /* 17 */ {      3,    -20,     14,    136,   -685,   2086,  -5441,  19243,
+                21289,  -5246,   1828,   -506,     41,     53,    -31,      4 },
+    /* 18 */ {      2,    -15,     -4,    178,   -760,   2182,  -5467,  18174,
+                22257,  -5072,   1666,   -403,    -12,     74,    -37,      5 },
+    /* 19 */ {      2,    -10,    -21,    217,   -825,   2255,  -5448,  17081,
+                23182,  -4846,   1482,   -291,    -68,     96,    -44,      6 },
+    /* 20 */ {      1,     -5,    -36,    251,   -881,   2307,  -5386,  15970,
+                24057,  -4566,   1277,   -171,   -126,    119,    -50,      7 },
+    /* 21 */ {      1,     -1,    -50,    282,   -926,   2338,  -5283,  14845,
+                24877,  -4231,   1052,    -44,   -186,    142,    -56,      8 },
+    /* 22 */ {      0,      2,    -62,    308,   -962,   2348,  -5144,  13712,
+                25646,  -3840,    807,     90,   -248,    165,    -63,      9 },
+    /* 23 */ {      0,      6,    -73,    330,   -987,   2339,  -4970,  12577,
+                26350,  -3394,    543,    229,   -311,    188,    -69,     10 },
+    /* 24 */ {      0,      8,    -83,    348,  -1004,   2311,  -4765,  11444,
+                26992,  -2891,    262,    374,   -375,    211,    -76,     12 },
+    /* 25 */ {      0,     11,    -91,    362,  -1011,   2266,  -4531,  10317,
+                27565,  -2334,    -34,    522,   -439,    234,    -82,     13 },
+    /* 26 */ {      0,     13,    -97,    372,  -1009,   2204,  -4273,   9203,
+                28067,  -1721,   -343,    672,   -503,    256,    -87,     14 },
+    /* 27 */ {      0,     15,   -103,    378,   -999,   2127,  -3992,   8106,
+                28499,  -1055,   -665,    824,   -566,    277,    -93,     15 },
+    /* 28 */ {      0,     16,   -106,    381,   -982,   2036,  -3693,   7031,
+                28853,   -336,   -997,    977,   -627,    297,    -98,     16 },
+    /* 29 */ {      0,     17,   -109,    380,   -956,   1932,  -3378,   5981,
+                29131,    434,  -1335,   1128,   -686,    315,   -102,     16 },
+    /* 30 */ {      0,     17,   -110,    376,   -925,   1818,  -3051,   4960,
+                29332,   1252,  -1679,   1276,   -742,    332,   -105,     17 },
+    /* 31 */ {      0,     18,   -111,    369,   -887,   1693,  -2714,   3974,
+                29452,   2117,  -2025,   1421,   -795,    347,   -108,     17 },
+};
+
 
 static void
 zero_channel(gbc_audio_channel_t *c)
@@ -471,12 +551,15 @@ void
 gbc_audio_init(gbc_audio_t *audio)
 {
     memset(audio, 0, sizeof(gbc_audio_t));
+    audio->output_sample_step_remainder = SAMPLE_TO_AUDIO_CYCLES_REMAINDER;
+    audio->frame_sequencer_clocks = AUDIO_FRAME_SEQUENCER_UNKNOWN;
 }
 
 uint8_t
 audio_read(void *udata, uint16_t addr)
 {
     gbc_audio_t *audio = (gbc_audio_t*)udata;
+    gbc_audio_sync(audio, *audio->clocks);
 
     uint8_t port = IO_ADDR_PORT(addr);
     if (port >= IO_PORT_NR10 && port <= IO_PORT_NR52) {
@@ -491,6 +574,7 @@ uint8_t
 audio_write(void *udata, uint16_t addr, uint8_t data)
 {
     gbc_audio_t *audio = (gbc_audio_t*)udata;
+    gbc_audio_sync(audio, *audio->clocks);
 
     uint8_t port = IO_ADDR_PORT(addr);
     if (port >= IO_PORT_NR10 && port <= IO_PORT_NR52) {
@@ -515,6 +599,7 @@ gbc_audio_connect(gbc_audio_t *audio, gbc_memory_t *mem)
     entry.addr_end = AUDIO_END;
     entry.read = audio_read;
     entry.write = audio_write;
+    entry.remap = NULL;
     entry.udata = audio;
 
     register_memory_map(mem, &entry);
@@ -592,6 +677,89 @@ ch1_sweep(gbc_audio_t *audio)
 }
 
 
+/* the duty step is over, the next one starts with the period in the register */
+static void
+square_wrap(gbc_audio_channel_t *ch)
+{
+    /* the sound effect is wrong if we use the value in the shadow period */
+    if (ch->waveform_idx == WAVEFORM_SAMPLES)
+        ch->waveform_idx = 1;
+    else
+        ch->waveform_idx += 1;
+    ch->sample_cycles = (CHANNEL_PERIOD(ch) << 1);
+}
+
+static inline int8_t
+square_output(gbc_audio_channel_t *ch)
+{
+    /* nothing is played until the first step after a trigger */
+    if (ch->waveform_idx == 0)
+        return 0;
+    return WAVEFORM_SAMPLE(_duty_waveform[CHANNEL_DUTY(ch)], ch->waveform_idx - 1) * ch->volume;
+}
+
+static void
+wave_wrap(gbc_audio_channel_t *ch)
+{
+    if (ch->waveform_idx == CH3_WAVEFORM_SAMPLES)
+        ch->waveform_idx = 1;
+    else
+        ch->waveform_idx += 1;
+    ch->sample_cycles = 0x800 - CHANNEL_PERIOD(ch);
+}
+
+static inline int8_t
+wave_output(gbc_audio_t *audio)
+{
+    gbc_audio_channel_t *ch = &(audio->c3);
+    uint8_t volume = CHANNEL3_OUTPUT_LEVEL(ch);
+    if (volume == 0)
+        return 0;
+
+    uint8_t sample_offset = (ch->waveform_idx-1) / 2;
+    uint8_t wave_form = audio->waveforms[sample_offset];
+    if (ch->waveform_idx % 2 == 0)
+        wave_form &= 0xf;
+    else
+        wave_form >>= 4;
+
+    return wave_form >> (volume-1);
+}
+
+static void
+noise_shift(gbc_audio_channel_t *ch)
+{
+    uint8_t shift = CHANNEL4_CLOCK_SHIFT(ch);
+    uint8_t divider = CHANNEL4_CLOCK_DIVIDER(ch);
+    uint16_t lfsr = ch->lfsr;
+
+    uint8_t b = (lfsr & 1) ^ ((lfsr >> 1) & 1);
+    lfsr >>= 1;
+    lfsr &= ~(1 << 14);
+    lfsr |= b << 14;
+    if (CHANNEL4_LFSR_SHORT_MODE(ch)) {
+        lfsr &= ~(1 << 6);
+        lfsr |= b << 6;
+    }
+
+    ch->lfsr = lfsr;
+
+    uint32_t period = 1 << (shift + 1);
+    if (divider == 0) {
+        period >>= 1;
+    } else {
+        period *= divider;
+    }
+
+    ch->sample_cycles = period * 2;
+}
+
+static inline int8_t
+noise_output(gbc_audio_channel_t *ch)
+{
+    return (ch->lfsr & 1) * ch->volume;
+}
+
 static int8_t
 ch1_audio(gbc_audio_t *audio)
 {
@@ -662,20 +830,11 @@ ch1_audio(gbc_audio_t *audio)
         }
     }
 
-    /* the sound effect is wrong if we use the value in the shadow period */
-    uint16_t sample_period = CHANNEL_PERIOD(ch);
     ch->sample_cycles++;
-    if (ch->sample_cycles == (0x800 << 1)) {
-        if (ch->waveform_idx == WAVEFORM_SAMPLES)
-            ch->waveform_idx = 1;
-        else
-            ch->waveform_idx += 1;
-        ch->sample_cycles = (sample_period << 1);
-    }
+    if (ch->sample_cycles == (0x800 << 1))
+        square_wrap(ch);
 
-    uint8_t on = WAVEFORM_SAMPLE(_duty_waveform[CHANNEL_DUTY(ch)], ch->waveform_idx-1);
-
-    return on * ch->volume;
+    return square_output(ch);
 }
 
 static int8_t
@@ -735,19 +894,11 @@ ch2_audio(gbc_audio_t *audio)
         }
     }
 
-    uint16_t sample_period = CHANNEL_PERIOD(ch);
     ch->sample_cycles++;
-    if (ch->sample_cycles == (0x800 << 1)) {
-        if (ch->waveform_idx == WAVEFORM_SAMPLES)
-            ch->waveform_idx = 1;
-        else
-            ch->waveform_idx += 1;
-        ch->sample_cycles = (sample_period << 1);
-    }
-
-    uint8_t on = WAVEFORM_SAMPLE(_duty_waveform[CHANNEL_DUTY(ch)], ch->waveform_idx-1);
+    if (ch->sample_cycles == (0x800 << 1))
+        square_wrap(ch);
 
-    return on * ch->volume;
+    return square_output(ch);
 }
 
 static int8_t
@@ -797,28 +948,11 @@ ch3_audio(gbc_audio_t *audio)
         return 0;
     }
 
-    uint16_t sample_period = CHANNEL_PERIOD(ch);
     ch->sample_cycles -= 1;
-    if (ch->sample_cycles <= 0) {
-        if (ch->waveform_idx == CH3_WAVEFORM_SAMPLES)
-            ch->waveform_idx = 1;
-        else
-            ch->waveform_idx += 1;
-        ch->sample_cycles = 0x800 - sample_period;
-    }
-
-    uint8_t volume = CHANNEL3_OUTPUT_LEVEL(ch);
-    if (volume == 0)
-        return 0;
-
-    uint8_t sample_offset = (ch->waveform_idx-1) / 2;
-    uint8_t wave_form = audio->waveforms[sample_offset];
-    if (ch->waveform_idx % 2 == 0)
-        wave_form &= 0xf;
-    else
-        wave_form >>= 4;
+    if (ch->sample_cycles <= 0)
+        wave_wrap(ch);
 
-    return wave_form >> (volume-1);
+    return wave_output(audio);
 }
 
 static int8_t
@@ -880,41 +1014,51 @@ ch4_audio(gbc_audio_t *audio)
     }
 
     if (audio->cycles % FRAME_NOISE_TICK == 0) {
-
-        if (ch->sample_cycles == 0) {
-            uint8_t shift = CHANNEL4_CLOCK_SHIFT(ch);
-            uint8_t divider = CHANNEL4_CLOCK_DIVIDER(ch);
-            uint16_t lfsr = ch->lfsr;
-
-            uint8_t b = (lfsr & 1) ^ ((lfsr >> 1) & 1);
-            lfsr >>= 1;
-            lfsr &= ~(1 << 14);
-            lfsr |= b << 14;
-            if (CHANNEL4_LFSR_SHORT_MODE(ch)) {
-                lfsr &= ~(1 << 6);
-                lfsr |= b << 6;
-            }
-
-            ch->lfsr = lfsr;
-
-            uint32_t period = 1 << (shift + 1);
-            if (divider == 0) {
-                period >>= 1;
-            } else {
-                period *= divider;
-            }
-
-            ch->sample_cycles = period * 2;
-        } else {
+        if (ch->sample_cycles == 0)
+            noise_shift(ch);
+        else
             ch->sample_cycles--;
-        }
     }
 
-    return (ch->lfsr & 1) * ch->volume;
+    return noise_output(ch);
 }
 
+/* the channels pick the step up in their next audio cycle */
 void
-gbc_audio_cycle(gbc_audio_t *audio)
+gbc_audio_frame_sequencer_step(gbc_audio_t *audio)
+{
+    audio->frame_sequencer++;
+    /* rewind */
+    if (audio->frame_sequencer == FRAME_ENVELOPE_SWEEP)
+        audio->frame_sequencer = 0;
+
+    audio->frame_sound_length = 0;
+    audio->frame_envelope_sweep = 0;
+    audio->frame_freq_sweep = 0;
+
+    /* https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Frame_Sequencer */
+    if (audio->frame_sequencer == 0 ||
+        audio->frame_sequencer == 2 ||
+        audio->frame_sequencer == 4 ||
+        audio->frame_sequencer == 6)
+        audio->frame_sound_length = 1;
+
+    if (audio->frame_sequencer == 7)
+        audio->frame_envelope_sweep = 1;
+
+    if (audio->frame_sequencer == 2 ||
+        audio->frame_sequencer == 6)
+        audio->frame_freq_sweep = 1;
+
+    audio->c1.frame_sequencer_flag = 1;
+    audio->c2.frame_sequencer_flag = 1;
+    audio->c3.frame_sequencer_flag = 1;
+    audio->c4.frame_sequencer_flag = 1;
+}
+
+/* watches DIV every clock, the lockstep way, gbc_audio_sync knows the steps in advance */
+static void
+audio_frame_sequencer(gbc_audio_t *audio)
 {
     uint8_t div = IO_PORT_READ(audio->mem, IO_PORT_DIV);
     uint8_t mask = 0x10;
@@ -924,99 +1068,381 @@ gbc_audio_cycle(gbc_audio_t *audio)
         mask = 0x20;
     }
 
-    if ((audio->div_apu & mask) && !(div & mask)) {
-        audio->frame_sequencer++;
-        /* rewind */
-        if (audio->frame_sequencer == FRAME_ENVELOPE_SWEEP)
-            audio->frame_sequencer = 0;
+    if ((audio->div_apu & mask) && !(div & mask))
+        gbc_audio_frame_sequencer_step(audio);
 
-        audio->frame_sound_length = 0;
-        audio->frame_envelope_sweep = 0;
-        audio->frame_freq_sweep = 0;
-
-        /* https://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware#Frame_Sequencer */
-        if (audio->frame_sequencer == 0 ||
-            audio->frame_sequencer == 2 ||
-            audio->frame_sequencer == 4 ||
-            audio->frame_sequencer == 6)
-            audio->frame_sound_length = 1;
+    audio->div_apu = div;
+}
 
-        if (audio->frame_sequencer == 7)
-            audio->frame_envelope_sweep = 1;
+/* mixes the channel outputs of the current audio cycle, a change becomes a step in the output */
+static void
+audio_mix(gbc_audio_t *audio)
+{
+    uint8_t l_volume = LEFT_VOLUME(audio->NR50);
+    uint8_t r_volume = RIGHT_VOLUME(audio->NR50);
+    int32_t levels[2] = {0, 0};
 
-        if (audio->frame_sequencer == 2 ||
-            audio->frame_sequencer == 6)
-            audio->frame_freq_sweep = 1;
+    for (int i = 0; i < 4; i++) {
+        if (audio->NR51 & (SOUND_PANNING_CH1_LEFT << i))
+            levels[0] += audio->outputs[i];
+        if (audio->NR51 & (SOUND_PANNING_CH1_RIGHT << i))
+            levels[1] += audio->outputs[i];
+    }
+    /* https://gbdev.io/pandocs/Audio_Registers.html#ff24--nr50-master-volume--vin-panning, 0 is 1/8 */
+    levels[0] *= l_volume + 1;
+    levels[1] *= r_volume + 1;
 
-        audio->c1.frame_sequencer_flag = 1;
-        audio->c2.frame_sequencer_flag = 1;
-        audio->c3.frame_sequencer_flag = 1;
-        audio->c4.frame_sequencer_flag = 1;
+    if (levels[0] == audio->levels[0] && levels[1] == audio->levels[1])
+        return;
 
+    /* output_sample_cycles counts the cycles left in the output sample down to 0 */
+    int32_t elapsed = audio->sample_divider - 1 - audio->output_sample_cycles;
+    uint32_t phase = 0;
+    if (elapsed > 0)
+        phase = elapsed * AUDIO_BLEP_PHASES / audio->sample_divider;
+
+    const int32_t *kernel = _blep_kernel[phase];
+    for (int c = 0; c < 2; c++) {
+        int32_t delta = levels[c] - audio->levels[c];
+        if (!delta)
+            continue;
+
+        int32_t *buffer = audio->blep_buffer[c];
+        for (int i = 0; i < AUDIO_BLEP_WIDTH; i++)
+            buffer[(audio->blep_pos + i) & (AUDIO_BLEP_BUFFER - 1)] += delta * kernel[i];
+        audio->levels[c] = levels[c];
     }
+}
 
-    audio->div_apu = div;
+/* the output clock, a sample is due when output_sample_cycles reaches 0 */
+static void
+audio_output(gbc_audio_t *audio)
+{
+    if (audio->output_sample_cycles == 0) {
+        int16_t *frame = audio->output + audio->output_frames * 2;
+        for (int c = 0; c < 2; c++) {
+            /*
+              the channels only ever add to the mix, the one pole high-pass
+              y += x - x' - y / 1024 centers it on 0, and x - x' is just
+              what the steps added to this sample
+            */
+            audio->blep_integrator[c] += audio->blep_buffer[c][audio->blep_pos];
+            audio->blep_integrator[c] -= audio->blep_integrator[c] >> AUDIO_DC_BLOCK_SHIFT;
+            audio->blep_buffer[c][audio->blep_pos] = 0;
+
+            int32_t sample = audio->blep_integrator[c] >> AUDIO_OUTPUT_SHIFT;
+            frame[c] = sample > INT16_MAX ? INT16_MAX : (sample < INT16_MIN ? INT16_MIN : sample);
+        }
+        audio->blep_pos = (audio->blep_pos + 1) & (AUDIO_BLEP_BUFFER - 1);
 
-    audio->m_cycles++;
-    if (audio->m_cycles != AUDIO_CLOCK_CYCLES) {
-        return;
+        if (++audio->output_frames == AUDIO_OUTPUT_FRAMES)
+            gbc_audio_flush(audio);
+
+        audio->output_sample_cycles = SAMPLE_TO_AUDIO_CYCLES;
+        audio->output_sample_cycles_remainder += audio->output_sample_step_remainder;
+
+        if (audio->output_sample_cycles_remainder >= REMAINDER_SCALING_FACTOR) {
+            audio->output_sample_cycles++;
+            audio->output_sample_cycles_remainder -= REMAINDER_SCALING_FACTOR;
+        }
+        audio->sample_divider = audio->output_sample_cycles;
     }
 
-    audio->m_cycles = 0;
+    audio->output_sample_cycles--;
+}
+
+/* an audio cycle through the whole channel logic, the registers may have changed since the last one */
+static void
+audio_step(gbc_audio_t *audio)
+{
     audio->cycles++;
 
-    if (!(audio->NR52 & NR52_AUDIO_ON))
+    if (audio->NR52 & NR52_AUDIO_ON) {
+        audio->outputs[0] = ch1_audio(audio);
+        audio->outputs[1] = ch2_audio(audio);
+        audio->outputs[2] = ch3_audio(audio);
+        audio->outputs[3] = ch4_audio(audio);
+
+        audio->NR52 &= ~0xf;
+        audio->NR52 |= (audio->c1.on)
+                        | ((audio->c2.on) << 1)
+                        | ((audio->c3.on) << 2)
+                        | ((audio->c4.on) << 3);
+    } else {
+        memset(audio->outputs, 0, sizeof(audio->outputs));
+    }
+
+    audio_mix(audio);
+    audio_output(audio);
+}
+
+#define AUDIO_NEVER UINT64_MAX
+
+/* audio cycles until the output may change, counting the cycle it changes in */
+static inline uint64_t
+square_next_edge(gbc_audio_channel_t *ch)
+{
+    if (!ch->on || ch->sample_cycles >= (0x800 << 1))
+        return AUDIO_NEVER;
+    return (0x800 << 1) - ch->sample_cycles;
+}
+
+static inline uint64_t
+wave_next_edge(gbc_audio_channel_t *ch)
+{
+    if (!ch->on || ch->sample_cycles == 0)
+        return AUDIO_NEVER;
+    return ch->sample_cycles;
+}
+
+static inline uint64_t
+noise_next_edge(gbc_audio_t *audio, gbc_audio_channel_t *ch)
+{
+    if (!ch->on)
+        return AUDIO_NEVER;
+    /* clocked every FRAME_NOISE_TICK cycles, it shifts on the clock that finds sample_cycles at 0 */
+    uint64_t tick = (audio->cycles / FRAME_NOISE_TICK + 1) * FRAME_NOISE_TICK;
+    return tick + (uint64_t)ch->sample_cycles * FRAME_NOISE_TICK - audio->cycles;
+}
+
+/*
+  A channel playing at volume 0 stays silent until the next register write or
+  frame sequencer step, its counters are moved in one go instead of stopping
+  at every edge.
+*/
+static inline uint8_t
+audio_silent(gbc_audio_t *audio, gbc_audio_channel_t *ch)
+{
+    if (!ch->on)
+        return 0;
+    if (ch == &audio->c3)
+        return CHANNEL3_OUTPUT_LEVEL(ch) == 0;
+    return ch->volume == 0;
+}
+
+static void
+square_skip(gbc_audio_channel_t *ch, uint64_t n)
+{
+    uint64_t edge = square_next_edge(ch);
+    if (n < edge) {
+        if (edge != AUDIO_NEVER)
+            ch->sample_cycles += n;
         return;
+    }
 
-    int8_t c1 = ch1_audio(audio);
-    int8_t c2 = ch2_audio(audio);
-    int8_t c3 = ch3_audio(audio);
-    int8_t c4 = ch4_audio(audio);
+    /* after the first wrap the period is the one in the register */
+    uint64_t period = (0x800 << 1) - (CHANNEL_PERIOD(ch) << 1);
+    uint64_t wraps = 1 + (n - edge) / period;
+    if (ch->waveform_idx == 0) {
+        ch->waveform_idx = 1;
+        wraps--;
+    }
+    ch->waveform_idx = (ch->waveform_idx - 1 + wraps) % WAVEFORM_SAMPLES + 1;
+    ch->sample_cycles = (CHANNEL_PERIOD(ch) << 1) + (n - edge) % period;
+}
 
-    audio->NR52 &= ~0xf;
-    audio->NR52 |= (audio->c1.on)
-                    | ((audio->c2.on) << 1)
-                    | ((audio->c3.on) << 2)
-                    | ((audio->c4.on) << 3);
+static void
+wave_skip(gbc_audio_channel_t *ch, uint64_t n)
+{
+    uint64_t edge = wave_next_edge(ch);
+    if (n < edge) {
+        if (edge != AUDIO_NEVER)
+            ch->sample_cycles -= n;
+        return;
+    }
 
-    uint8_t l_volume = LEFT_VOLUME(audio->NR50);
-    uint8_t r_volume = RIGHT_VOLUME(audio->NR50);
+    uint64_t period = 0x800 - CHANNEL_PERIOD(ch);
+    uint64_t wraps = 1 + (n - edge) / period;
+    if (ch->waveform_idx == 0) {
+        ch->waveform_idx = 1;
+        wraps--;
+    }
+    ch->waveform_idx = (ch->waveform_idx - 1 + wraps) % CH3_WAVEFORM_SAMPLES + 1;
+    ch->sample_cycles = period - (n - edge) % period;
+}
 
-    uint16_t left = 0;
-    uint16_t right = 0;
+/* the lfsr has to go through every shift, it is what the channel plays once it is loud again */
+static void
+noise_skip(gbc_audio_t *audio, gbc_audio_channel_t *ch, uint64_t n)
+{
+    uint64_t cycles = audio->cycles;
+    uint64_t end = cycles + n;
+
+    for (;;) {
+        uint64_t tick = (cycles / FRAME_NOISE_TICK + 1) * FRAME_NOISE_TICK;
+        uint64_t edge = tick + (uint64_t)ch->sample_cycles * FRAME_NOISE_TICK;
+        if (edge > end)
+            break;
+        noise_shift(ch);
+        cycles = edge;
+    }
+    ch->sample_cycles -= end / FRAME_NOISE_TICK - cycles / FRAME_NOISE_TICK;
+}
+
+/*
+  Runs n audio cycles in which nothing but the period counters move: no
+  register was written and the frame sequencer did not step, so the
+  channels can jump from one edge to the next.
+*/
+static void
+audio_run_edges(gbc_audio_t *audio, uint64_t n)
+{
+    gbc_audio_channel_t *c1 = &(audio->c1);
+    gbc_audio_channel_t *c2 = &(audio->c2);
+    gbc_audio_channel_t *c3 = &(audio->c3);
+    gbc_audio_channel_t *c4 = &(audio->c4);
+    uint8_t on = audio->NR52 & NR52_AUDIO_ON;
+    uint8_t on1 = on, on2 = on, on3 = on, on4 = on;
+
+    if (on && n) {
+        if (audio_silent(audio, c1)) {
+            square_skip(c1, n);
+            on1 = 0;
+        }
+        if (audio_silent(audio, c2)) {
+            square_skip(c2, n);
+            on2 = 0;
+        }
+        if (audio_silent(audio, c3)) {
+            wave_skip(c3, n);
+            on3 = 0;
+        }
+        if (audio_silent(audio, c4)) {
+            noise_skip(audio, c4, n);
+            on4 = 0;
+        }
+    }
 
-    left = ((audio->NR51 & SOUND_PANNING_CH1_LEFT) ? c1 : 0) + \
-              ((audio->NR51 & SOUND_PANNING_CH2_LEFT) ? c2 : 0) + \
-              ((audio->NR51 & SOUND_PANNING_CH3_LEFT) ? c3 : 0) + \
-              ((audio->NR51 & SOUND_PANNING_CH4_LEFT) ? c4 : 0);
+    while (n) {
+        uint64_t step = (uint64_t)audio->output_sample_cycles + 1;
+        uint64_t e1 = AUDIO_NEVER, e2 = AUDIO_NEVER, e3 = AUDIO_NEVER, e4 = AUDIO_NEVER;
+
+        if (on1)
+            e1 = square_next_edge(c1);
+        if (on2)
+            e2 = square_next_edge(c2);
+        if (on3)
+            e3 = wave_next_edge(c3);
+        if (on4)
+            e4 = noise_next_edge(audio, c4);
+        if (n < step) step = n;
+        if (e1 < step) step = e1;
+        if (e2 < step) step = e2;
+        if (e3 < step) step = e3;
+        if (e4 < step) step = e4;
+
+        /* the cycles before the last one only count */
+        if (e1 == step) {
+            square_wrap(c1);
+            audio->outputs[0] = square_output(c1);
+        } else if (e1 != AUDIO_NEVER) {
+            c1->sample_cycles += step;
+        }
 
-    right = ((audio->NR51 & SOUND_PANNING_CH1_RIGHT) ? c1 : 0) + \
-              ((audio->NR51 & SOUND_PANNING_CH2_RIGHT) ? c2 : 0) + \
-              ((audio->NR51 & SOUND_PANNING_CH3_RIGHT) ? c3 : 0) + \
-              ((audio->NR51 & SOUND_PANNING_CH4_RIGHT) ? c4 : 0);
+        if (e2 == step) {
+            square_wrap(c2);
+            audio->outputs[1] = square_output(c2);
+        } else if (e2 != AUDIO_NEVER) {
+            c2->sample_cycles += step;
+        }
 
-    audio->left_sample += left * l_volume / 4;
-    audio->right_sample += right * r_volume / 4;
+        if (e3 == step) {
+            wave_wrap(c3);
+            audio->outputs[2] = wave_output(audio);
+        } else if (e3 != AUDIO_NEVER) {
+            c3->sample_cycles -= step;
+        }
 
-    if (audio->output_sample_cycles == 0) {
-        /* linear interpolation */
-        uint8_t l_sample = 0, r_sample = 0;
-        if (audio->sample_divider > 0) {
-            l_sample = audio->left_sample / audio->sample_divider;
-            r_sample = audio->right_sample / audio->sample_divider;
+        if (e4 == step) {
+            noise_shift(c4);
+            audio->outputs[3] = noise_output(c4);
+        } else if (e4 != AUDIO_NEVER) {
+            c4->sample_cycles -= (audio->cycles + step) / FRAME_NOISE_TICK - audio->cycles / FRAME_NOISE_TICK;
         }
 
-        audio->audio_write(l_sample, r_sample);
-        audio->output_sample_cycles = SAMPLE_TO_AUDIO_CYCLES;
-        audio->output_sample_cycles_remainder += SAMPLE_TO_AUDIO_CYCLES_REMAINDER;
+        audio->cycles += step;
+        audio->output_sample_cycles -= step - 1;
+        n -= step;
 
-        if (audio->output_sample_cycles_remainder >= REMAINDER_SCALING_FACTOR) {
-            audio->output_sample_cycles++;
-            audio->output_sample_cycles_remainder -= REMAINDER_SCALING_FACTOR;
+        audio_mix(audio);
+        audio_output(audio);
+    }
+}
+
+/* only the first audio cycle can see a register write or a frame sequencer step */
+static void
+audio_run_cycles(gbc_audio_t *audio, uint64_t n)
+{
+    uint64_t m_cycles = audio->m_cycles + n;
+    audio->m_cycles = m_cycles % AUDIO_CLOCK_CYCLES;
+    m_cycles /= AUDIO_CLOCK_CYCLES;
+    if (!m_cycles)
+        return;
+
+    audio_step(audio);
+    audio_run_edges(audio, m_cycles - 1);
+}
+
+/*
+  The audio is left behind until something can tell: the cpu touches its
+  registers (audio_read, audio_write) or the frame is over. Then it catches up
+  in pieces split at the frame sequencer steps, gbc.c works out when DIV makes
+  them happen.
+*/
+void
+gbc_audio_sync(gbc_audio_t *audio, uint64_t clocks)
+{
+    while (audio->synced_clocks < clocks) {
+        uint64_t end = clocks;
+
+        if (audio->frame_sequencer_clocks == audio->synced_clocks) {
+            gbc_audio_frame_sequencer_step(audio);
+            audio->frame_sequencer_clocks += AUDIO_FRAME_SEQUENCER_CLOCKS;
         }
-        audio->left_sample = audio->right_sample = 0;
-        audio->sample_divider = audio->output_sample_cycles;
+        if (audio->frame_sequencer_clocks < end)
+            end = audio->frame_sequencer_clocks;
+
+        audio_run_cycles(audio, end - audio->synced_clocks);
+        audio->synced_clocks = end;
     }
 
-    audio->output_sample_cycles--;
+    audio->div_apu = IO_PORT_READ(audio->mem, IO_PORT_DIV);
+}
+
+void
+gbc_audio_cycle(gbc_audio_t *audio)
+{
+    audio_frame_sequencer(audio);
+    audio_run_cycles(audio, 1);
+    audio->synced_clocks++;
+}
+
+void
+gbc_audio_flush(gbc_audio_t *audio)
+{
+    if (audio->output_frames)
+        audio->audio_write(audio->output, audio->output_frames);
+    audio->output_frames = 0;
+}
+
+void
+gbc_audio_rate_control(gbc_audio_t *audio)
+{
+    if (!audio->drc_target || !audio->audio_queued) {
+        audio->output_sample_step_remainder = SAMPLE_TO_AUDIO_CYCLES_REMAINDER;
+        return;
+    }
+
+    /* -1 when the queue ran dry, 1 when it holds twice the target */
+    double error = ((double)audio->audio_queued(audio) - audio->drc_target) / audio->drc_target;
+    if (error > 1)
+        error = 1;
+
+    /*
+      a fuller queue takes more audio cycles per sample, so fewer samples per
+      frame. The whole adjustment is a fraction of a cycle per sample, the
+      integer part stays SAMPLE_TO_AUDIO_CYCLES
+    */
+    double step = (double)AUDIO_CLOCK_RATE / GBC_AUDIO_SAMPLE_RATE * (1 + error * GBC_AUDIO_DRC_MAX_DELTA);
+    audio->output_sample_step_remainder = (step - SAMPLE_TO_AUDIO_CYCLES) * REMAINDER_SCALING_FACTOR;
 }
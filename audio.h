@@ -20,6 +20,16 @@
 #define GBC_AUDIO_SAMPLE_RATE 44100
 #define GBC_AUDIO_SAMPLE_SIZE (GBC_AUDIO_SAMPLE_RATE / FRAME_PER_SECOND)
 
+/*
+  Dynamic rate control, for frontends that pace the frames with a timer or the
+  display. The emulated and the host audio clock never agree exactly, so before
+  every frame the output rate is nudged by up to GBC_AUDIO_DRC_MAX_DELTA
+  towards having audio->drc_target samples still queued, see gbc_audio_rate_control.
+  A frame adds GBC_AUDIO_SAMPLE_SIZE on top, so the queue holds 1 to 2 frames.
+*/
+#define GBC_AUDIO_DRC_MAX_DELTA 0.005
+#define GBC_AUDIO_DRC_TARGET    GBC_AUDIO_SAMPLE_SIZE   /* about 17ms */
+
 /* https://gbdev.io/pandocs/Audio_Registers.html#ff1d--nr33-channel-3-period-low-write-only */
 /* Audio module runs at the period clock rate of channel 3, which is the fastest, other channels runs at half of this rate */
 #define AUDIO_CLOCK_RATE        (1048576 << 1)
@@ -29,6 +39,8 @@
 #define NOISE_CLOCK_RATE        524288
 
 #define FRAME_SEQUENCER_CYCLES (AUDIO_CLOCK_RATE / 512) /* runs at 512Hz */
+#define AUDIO_FRAME_SEQUENCER_CLOCKS (CLOCK_RATE / 512)  /* in base clocks, at either speed */
+#define AUDIO_FRAME_SEQUENCER_UNKNOWN UINT64_MAX
 #define FRAME_ENVELOPE_SWEEP   8
 #define FRAME_SOUND_LENGTH     2
 #define FRAME_FREQ_SWEEP       4
@@ -75,6 +87,19 @@
 #define CHANNEL4_LFSR_SHORT_MODE(c) ( ((c)->NRx3) & 0x8)
 #define CHANNEL4_CLOCK_DIVIDER(c) ( ((c)->NRx3) & 0x7)
 
+/* band limited steps, see audio.c */
+#define AUDIO_BLEP_PHASES   32
+#define AUDIO_BLEP_WIDTH    16      /* output samples a step is spread over */
+#define AUDIO_BLEP_BUFFER   32      /* a power of two above AUDIO_BLEP_WIDTH */
+#define AUDIO_BLEP_SHIFT    15
+
+/* int16 stereo frames, handed to audio_write in batches */
+#define AUDIO_OUTPUT_FRAMES     512
+/* the mix is at most 4 * 15 * 8, 64 times that still fits an int16 */
+#define AUDIO_OUTPUT_SHIFT      (AUDIO_BLEP_SHIFT - 6)
+/* the integrator leaks 1/1024 a sample, a high-pass around 7Hz that takes the DC out */
+#define AUDIO_DC_BLOCK_SHIFT    10
+
 #define WAVEFORM_SAMPLE(wav, idx) ((wav) & (1 << (idx)) ? 1 : 0)
 
 #define SAMPLE_TO_AUDIO_CYCLES (AUDIO_CLOCK_RATE / GBC_AUDIO_SAMPLE_RATE)
@@ -137,14 +162,27 @@ struct gbc_audio {
     uint8_t NR50;
     gbc_memory_t *mem;
 
-    void (*audio_write)(int8_t, int8_t);
+    /* n interleaved stereo frames, left first, the buffer is only valid during the call */
+    void (*audio_write)(const int16_t *frames, size_t n);
     void (*audio_update)(void *udata);
+    /* samples (per channel) the frontend still has to play, optional, GBC_PACING_AUDIO needs it */
+    uint32_t (*audio_queued)(void *udata);
 
     uint32_t output_sample_cycles_remainder;
+    uint32_t output_sample_step_remainder;  /* SAMPLE_TO_AUDIO_CYCLES_REMAINDER moved by the rate control */
+    uint32_t drc_target;            /* samples (per channel) to keep queued, needs audio_queued, 0 is a fixed rate */
     uint16_t output_sample_cycles;
-    int16_t left_sample;
-    int16_t right_sample;
-    int16_t sample_divider;
+    int16_t sample_divider;         /* audio cycles in the current output sample */
+
+    /* band limited mixer, output only, see audio_mix */
+    int8_t outputs[4];              /* of every channel in the last audio cycle */
+    int32_t levels[2];              /* left and right mix of the outputs */
+    int32_t blep_integrator[2];     /* leaky, it is the DC blocker as well */
+    int32_t blep_buffer[2][AUDIO_BLEP_BUFFER];
+    uint8_t blep_pos;
+
+    int16_t output[AUDIO_OUTPUT_FRAMES * 2];
+    uint16_t output_frames;         /* waiting in output, empty between frames */
 
     uint8_t m_cycles;
     uint8_t frame_sequencer;
@@ -155,11 +193,28 @@ struct gbc_audio {
 
     uint8_t div_apu;
 
+    /* lazy catch-up, see gbc_audio_sync */
+    const uint64_t *clocks;         /* base clocks of the machine, the registers catch up to it */
+    uint64_t synced_clocks;         /* base clocks the audio has been brought up to */
+    uint64_t frame_sequencer_clocks;    /* base clock of the next step, worked out by gbc.c */
+    /* the DIV counter the step was worked out from, a reset or a speed switch moves it */
+    uint64_t frame_sequencer_cycles;
+    uint16_t frame_sequencer_counter;
+    uint8_t frame_sequencer_mode;   /* the DIV bit it watched and the speed */
+
     uint8_t waveforms[CH3_WAVEFORM_SAMPLES/2];
 };
 
 void gbc_audio_connect(gbc_audio_t *audio, gbc_memory_t *mem);
 void gbc_audio_init(gbc_audio_t *audio);
 void gbc_audio_cycle(gbc_audio_t *audio);
+/* brings the audio up to the given base clock */
+void gbc_audio_sync(gbc_audio_t *audio, uint64_t clocks);
+/* DIV just clocked the frame sequencer */
+void gbc_audio_frame_sequencer_step(gbc_audio_t *audio);
+/* hands the frames produced so far to audio_write, called at the end of every frame */
+void gbc_audio_flush(gbc_audio_t *audio);
+/* called before every frame, adjusts the output rate to the queue of the frontend */
+void gbc_audio_rate_control(gbc_audio_t *audio);
 
 #endif
\ No newline at end of file
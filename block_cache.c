@@ -0,0 +1,146 @@
+#include "block_cache.h"
+
+void
+gbc_block_cache_init(gbc_block_cache_t *cache)
+{
+    memset(cache, 0, sizeof(gbc_block_cache_t));
+}
+
+/* drops every block, e.g. when the whole memory has been replaced */
+void
+gbc_block_cache_flush(gbc_block_cache_t *cache)
+{
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++)
+        cache->blocks[i].host = NULL;
+    cache->current = NULL;
+}
+
+static void
+block_cache_invalidate(void *udata, uint8_t *host)
+{
+    gbc_block_cache_t *cache = (gbc_block_cache_t*)udata;
+
+    /* blocks never cross a page, see block_build */
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        gbc_block_t *block = &cache->blocks[i];
+        if (block->host >= host && block->host < host + MEMORY_PAGE_SIZE)
+            block->host = NULL;
+    }
+
+    cache->current = NULL;
+}
+
+void
+gbc_block_cache_connect(gbc_block_cache_t *cache, gbc_memory_t *mem)
+{
+    cache->mem = mem;
+    mem->invalidate = block_cache_invalidate;
+    mem->invalidate_udata = cache;
+}
+
+/* instructions that may not continue with the next one */
+static uint8_t
+block_ends(const instruction_t *ins, uint8_t prefixed)
+{
+    if (prefixed)
+        return 0;
+
+    switch (ins->opcode) {
+        case 0x10:                                              /* STOP */
+        case 0x76:                                              /* HALT */
+        case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:  /* JR */
+        case 0xc2: case 0xc3: case 0xca: case 0xd2: case 0xda:  /* JP */
+        case 0xe9:
+        case 0xc4: case 0xcc: case 0xcd: case 0xd4: case 0xdc:  /* CALL */
+        case 0xc0: case 0xc8: case 0xc9: case 0xd0: case 0xd8:  /* RET */
+        case 0xd9:
+        case 0xc7: case 0xcf: case 0xd7: case 0xdf:             /* RST */
+        case 0xe7: case 0xef: case 0xf7: case 0xff:
+            return 1;
+    }
+
+    return 0;
+}
+
+static gbc_block_t*
+block_build(gbc_block_cache_t *cache, gbc_block_t *block, const uint8_t *host, uint16_t pc)
+{
+    gbc_memory_t *mem = cache->mem;
+    const uint8_t *code = host;
+    uint16_t addr = pc;
+
+    block->host = NULL;
+    block->count = 0;
+
+    while (block->count < BLOCK_MAX_INSTRUCTIONS) {
+        instruction_t *ins = &block->ins[block->count];
+
+        decode_mem(mem->read, addr, mem, ins);
+
+        /* unknown instructions are left to the cpu to complain about,
+           and an instruction must not run into the next page, it may be mapped to something else */
+        if (!ins->func || (addr & MEMORY_PAGE_MASK) + ins->size > MEMORY_PAGE_SIZE)
+            break;
+
+        block->count++;
+        if (block_ends(ins, code[0] == PREFIX_CB) || (addr & MEMORY_PAGE_MASK) + ins->size == MEMORY_PAGE_SIZE)
+            break;
+
+        addr += ins->size;
+        code += ins->size;
+    }
+
+    if (block->count == 0)
+        return NULL;
+
+    block->host = host;
+    if (pc >= WRAM_BANK_0_BEGIN)
+        protect_wram_code(mem, host);
+
+    return block;
+}
+
+static gbc_block_t*
+block_lookup(gbc_block_cache_t *cache, uint16_t pc)
+{
+    gbc_memory_t *mem = cache->mem;
+    memory_page_t *page = &mem->pages[pc >> MEMORY_PAGE_SHIFT];
+
+    /* ROM and WRAM only, see gbc_block_cache_t */
+    if (!page->read || IN_RANGE(pc, VRAM_BEGIN, EXRAM_END) || pc > WRAM_ECHO_END)
+        return NULL;
+
+    const uint8_t *host = page->read + (pc & MEMORY_PAGE_MASK);
+    uintptr_t key = (uintptr_t)host;
+    gbc_block_t *block = &cache->blocks[(key ^ (key >> 9)) & (BLOCK_CACHE_SIZE - 1)];
+
+    if (block->host == host)
+        return block;
+
+    return block_build(cache, block, host, pc);
+}
+
+/* returns the pre-decoded instruction at pc, NULL if the code can not be cached */
+instruction_t*
+gbc_block_cache_fetch(gbc_block_cache_t *cache, uint16_t pc)
+{
+    gbc_block_t *block = cache->current;
+
+    if (!block || pc != cache->next_pc || cache->next == block->count ||
+        cache->map_generation != cache->mem->map_generation) {
+        block = block_lookup(cache, pc);
+        /* building a block may write protect its page, take the generation afterwards */
+        cache->map_generation = cache->mem->map_generation;
+        cache->current = block;
+        cache->next = 0;
+        if (!block)
+            return NULL;
+    }
+
+    instruction_t *ins = &block->ins[cache->next++];
+    cache->next_pc = pc + ins->size;
+    /* conditional instructions overwrite it when taken */
+    ins->r_cycles = ins->cycles;
+
+    return ins;
+}
@@ -0,0 +1,45 @@
+#ifndef _BLOCK_CACHE_H
+#define _BLOCK_CACHE_H
+
+#include "common.h"
+#include "memory.h"
+#include "instruction_set.h"
+
+#define BLOCK_CACHE_SIZE 512            /* blocks, direct mapped on the host address */
+#define BLOCK_MAX_INSTRUCTIONS 8
+
+typedef struct gbc_block gbc_block_t;
+typedef struct gbc_block_cache gbc_block_cache_t;
+
+/* pre-decoded straight-line code, it ends at the first jump/call/return */
+struct gbc_block
+{
+    const uint8_t *host;        /* host address of the first opcode, NULL if the slot is free */
+    uint8_t count;
+    instruction_t ins[BLOCK_MAX_INSTRUCTIONS];
+};
+
+/*
+  Blocks are keyed by the host address of the code rather than the PC, so
+  the ROM bank (or WRAM bank) is part of the key and bank switches need no
+  flushing. Only ROM and WRAM are cached, WRAM pages holding cached code are
+  write protected by the bus and a write to them drops their blocks.
+*/
+struct gbc_block_cache
+{
+    gbc_block_t blocks[BLOCK_CACHE_SIZE];
+    gbc_memory_t *mem;
+
+    /* where the cpu is in the current block */
+    gbc_block_t *current;
+    uint8_t next;
+    uint16_t next_pc;
+    uint32_t map_generation;
+};
+
+void gbc_block_cache_init(gbc_block_cache_t *cache);
+void gbc_block_cache_connect(gbc_block_cache_t *cache, gbc_memory_t *mem);
+void gbc_block_cache_flush(gbc_block_cache_t *cache);
+instruction_t* gbc_block_cache_fetch(gbc_block_cache_t *cache, uint16_t pc);
+
+#endif
@@ -5,7 +5,7 @@
 
 #define LOGO_ROW 8
 
-static uint8_t NINTENDO_LOGO[] = {
+static const uint8_t NINTENDO_LOGO[] = {
     0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
     0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E, 0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99,
     0xBB, 0xBB, 0x67, 0x63, 0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
@@ -51,11 +51,6 @@ cartridge_load(uint8_t *data)
         return NULL;
     }
     
-    if (cartridge->cart_cgb_flag != 0x80 && cartridge->cart_cgb_flag != 0xC0) {
-        LOG_ERROR("Invalid CGB flag\n");
-        return NULL;
-    }
-
     LOG_INFO("Title: %s\n", cartridge->title);
     LOG_INFO("ROM Size: %dk\n", cartridge_rom_size(cartridge) / 1024);
     LOG_INFO("ROM Banks: %d\n", cartridge_rom_banks(cartridge));
@@ -95,4 +90,32 @@ cartridge_load(uint8_t *data)
     );
 
     return cartridge;
-}
\ No newline at end of file
+}
+
+int
+cartridge_has_battery(cartridge_t *cart)
+{
+    switch (cart->cartridge_type) {
+        case CART_TYPE_MBC1_RAM_BATTERY:
+        case CART_TYPE_MBC2_BATTERY:
+        case CART_TYPE_ROM_RAM_BATTERY:
+        case CART_TYPE_MMM01_RAM_BATTERY:
+        case CART_TYPE_MBC3_TIMER_BATTERY:
+        case CART_TYPE_MBC3_TIMER_RAM_BATTERY:
+        case CART_TYPE_MBC3_RAM_BATTERY:
+        case CART_TYPE_MBC5_RAM_BATTERY:
+        case CART_TYPE_MBC5_RUMBLE_RAM_BATTERY:
+        case CART_TYPE_MBC7_SENSOR_RUMBLE_RAM_BATTERY:
+        case CART_TYPE_HUC1_RAM_BATTERY:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int
+cartridge_has_rtc(cartridge_t *cart)
+{
+    return cart->cartridge_type == CART_TYPE_MBC3_TIMER_BATTERY ||
+        cart->cartridge_type == CART_TYPE_MBC3_TIMER_RAM_BATTERY;
+}
@@ -58,11 +58,18 @@ struct cartridge
     uint8_t  code;                              /* 0x150          ROM */
 };
 
+#define CARTRIDGE_HEADER_END        0x150
+#define CARTRIDGE_MAX_ROM_SIZE      0x08        /* 8MB, the header value */
+
 #define cartridge_rom_size(cart)    (32 * (1 << (cart)->rom_size) * 1024)
 #define cartridge_rom_banks(cart)   (2 << cart->rom_size)
 #define cartridge_code(cart)        ((uint8_t*)&(cart->code))
 #define cartridge_code_size(cart)   (cartridge_code(cart) - (uint8_t*)(cart) + cartridge_rom_size((cart)))
 
 cartridge_t* cartridge_load(uint8_t *data);
+/* the external RAM keeps its contents when the power is off */
+int cartridge_has_battery(cartridge_t *cart);
+/* it has an MBC3 real time clock */
+int cartridge_has_rtc(cartridge_t *cart);
 
 #endif
\ No newline at end of file
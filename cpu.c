@@ -1,12 +1,20 @@
 #include <string.h>
 #include "cpu.h"
 #include "instruction_set.h"
+#include "block_cache.h"
 
 void
-gbc_cpu_init(gbc_cpu_t *cpu)
+gbc_cpu_init(gbc_cpu_t *cpu, gbc_block_cache_t *blocks)
 {
     memset(cpu, 0, sizeof(gbc_cpu_t));
 
+    cpu->blocks = blocks ? blocks : (gbc_block_cache_t*)malloc_memory(sizeof(gbc_block_cache_t));
+    if (!cpu->blocks) {
+        LOG_ERROR("[CPU] Failed to allocate the block cache\n");
+        abort();
+    }
+    gbc_block_cache_init(cpu->blocks);
+
     /* https://gbdev.io/pandocs/Power_Up_Sequence.html#cpu-registers */
     WRITE_R16(cpu, REG_PC, 0x0000);
     WRITE_R16(cpu, REG_SP, 0xFFFE);
@@ -48,6 +56,7 @@ gbc_cpu_connect(gbc_cpu_t *cpu, gbc_memory_t *mem)
     memory_map_entry_t entry;
     entry.read = ier_read;
     entry.write = ier_write;
+    entry.remap = NULL;
 
     entry.udata = cpu;
     entry.id = IE_REGISTER_ID;
@@ -56,6 +65,8 @@ gbc_cpu_connect(gbc_cpu_t *cpu, gbc_memory_t *mem)
 
     register_memory_map(mem, &entry);
     cpu->ifp = connect_io_port(mem, IO_PORT_IF);
+
+    gbc_block_cache_connect(cpu->blocks, mem);
 }
 
 uint8_t
@@ -146,7 +157,11 @@ gbc_cpu_cycle(gbc_cpu_t *cpu)
     }
 
     uint16_t pc = READ_R16(cpu, REG_PC);
-    instruction_t *ins = decode_mem(cpu->mem_read, pc, cpu->mem_data);
+    instruction_t decoded;
+    instruction_t *ins = gbc_block_cache_fetch(cpu->blocks, pc);
+
+    if (!ins)
+        ins = decode_mem(cpu->mem_read, pc, cpu->mem_data, &decoded);
 
     if (!ins->func) {
         LOG_ERROR("Unknown instruction [0x%x]\n", ins->opcode);
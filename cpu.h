@@ -6,6 +6,7 @@
 
 typedef struct cpu_register cpu_register_t;
 typedef struct gbc_cpu gbc_cpu_t;
+typedef struct gbc_block_cache gbc_block_cache_t;
 
 #define CLOCK_RATE 4194304                        /* 4.194304 MHz */
 #define CLOCK_CYCLE (1000000000 / CLOCK_RATE)     /* nanoseconds */
@@ -84,6 +85,7 @@ struct gbc_cpu
     memory_write mem_write;
     void *mem_data;
     uint8_t *ifp;           /* interrupt flag 'pointer'(it is a pointer to io port) */
+    gbc_block_cache_t *blocks;  /* pre-decoded code, see block_cache.h */
 
     uint64_t cycles;
     uint16_t ins_cycles;   /* current instruction cost */
@@ -155,7 +157,8 @@ struct gbc_cpu
 #define KEY1_CPU_SWITCH_ARMED 0x1
 #define KEY1_CPU_CURRENT_MODE 0x80
 
-void gbc_cpu_init(gbc_cpu_t *cpu);
+/* blocks NULL mallocs the block cache */
+void gbc_cpu_init(gbc_cpu_t *cpu, gbc_block_cache_t *blocks);
 void gbc_cpu_connect(gbc_cpu_t *cpu, gbc_memory_t *mem);
 void gbc_cpu_cycle(gbc_cpu_t *cpu);
 
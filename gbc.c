@@ -1,6 +1,9 @@
 #include "gbc.h"
 #include "instruction_set.h"
-#include "gui/gui.h"
+#include "block_cache.h"
+#include "rewind.h"
+
+static void gbc_mem_sync(void *udata, uint8_t write);
 
 
 void
@@ -11,21 +14,74 @@ gbc_load_boot_rom(gbc_t *gbc, const char *rom_path)
     //fread(gbc->mbc.rom_banks, 1, GBC_BOOT_ROM_SIZE, rom);
     fclose(rom);
     gbc->mem.boot_rom_enabled = 1;
+    remap_memory_map(&gbc->mem, ROM_BANK_0_ID);
 }
 
-int
-gbc_init(gbc_t *gbc, const char *game_rom, const char *boot_rom)
+typedef struct gbc_layout gbc_layout_t;
+
+/* offsets of the buffers from the gbc_t in gbc_create's block */
+struct gbc_layout
+{
+    size_t blocks;
+    size_t framebuffers;
+    size_t ram;
+    size_t size;
+};
+
+static size_t
+gbc_align(size_t size)
 {
+    return (size + GBC_ARENA_ALIGN - 1) & ~(size_t)(GBC_ARENA_ALIGN - 1);
+}
+
+static void
+gbc_layout(cartridge_t *cart, gbc_layout_t *layout)
+{
+#ifdef GBC_STATIC_MEMORY
+    /* they are in the gbc_t already */
+    layout->blocks = layout->framebuffers = layout->ram = 0;
+    layout->size = gbc_align(sizeof(gbc_t));
+#else
+    layout->blocks = gbc_align(sizeof(gbc_t));
+    layout->framebuffers = layout->blocks + gbc_align(sizeof(gbc_block_cache_t));
+    layout->ram = layout->framebuffers + gbc_align(FRAMEBUFFER_MEMORY_SIZE);
+    layout->size = layout->ram + gbc_align(gbc_mbc_ram_size(cart));
+#endif
+}
+
+/* arena is the gbc_create block the gbc_t starts, NULL mallocs the buffers one by one */
+static void
+gbc_setup(gbc_t *gbc, gbc_rom_t *rom, const char *boot_rom, uint8_t *arena)
+{
+    gbc_block_cache_t *blocks = NULL;
+    uint8_t *framebuffers = NULL, *ram = NULL;
+
     init_instruction_set();
     memset(gbc, 0, sizeof(gbc_t));
 
+#ifdef GBC_STATIC_MEMORY
+    blocks = &gbc->static_blocks;
+    framebuffers = gbc->static_framebuffers;
+    ram = gbc->static_ram;
+#else
+    if (arena) {
+        gbc_layout_t layout;
+        gbc_layout(rom->cart, &layout);
+        blocks = (gbc_block_cache_t*)(arena + layout.blocks);
+        framebuffers = arena + layout.framebuffers;
+        ram = arena + layout.ram;
+    }
+#endif
+    gbc->owns_buffers = blocks == NULL;
+
     gbc_mem_init(&gbc->mem);
-    gbc_cpu_init(&gbc->cpu);
+    gbc_cpu_init(&gbc->cpu, blocks);
     gbc_mbc_init(&gbc->mbc);
     gbc_timer_init(&gbc->timer);
     gbc_io_init(&gbc->io);
-    gbc_graphic_init(&gbc->graphic);
+    gbc_graphic_init(&gbc->graphic, framebuffers);
     gbc_audio_init(&gbc->audio);
+    gbc_scheduler_init(&gbc->sched);
 
     gbc_cpu_connect(&gbc->cpu, &gbc->mem);
     gbc_mbc_connect(&gbc->mbc, &gbc->mem);
@@ -34,37 +90,25 @@ gbc_init(gbc_t *gbc, const char *game_rom, const char *boot_rom)
     gbc_graphic_connect(&gbc->graphic, &gbc->mem);
     gbc_audio_connect(&gbc->audio, &gbc->mem);
 
-    FILE *cartridge = fopen(game_rom, "rb");
+    gbc->mem.sync = gbc_mem_sync;
+    gbc->mem.sync_udata = gbc;
 
-    if (!cartridge) {
-        LOG_ERROR("Failed to open cartridge\n");
-        return 1;
-    }
+    gbc->mbc.rom = rom;
+    gbc->mbc.clocks = &gbc->sched.clocks;
+    gbc->audio.clocks = &gbc->sched.clocks;
+    gbc_mbc_init_with_cart(&gbc->mbc, rom->cart, ram);
+    gbc->mbc.rom_banks = rom->file.data;
 
-    fseek(cartridge, 0, SEEK_END);
-    size_t size = ftell(cartridge);
-    rewind(cartridge);
-
-    uint8_t *data = (uint8_t*)malloc_memory(size);
-    if (!data) {
-        LOG_ERROR("Failed to allocate memory\n");
-        return 1;
-    }
-
-    size_t n = fread(data, 1, size, cartridge);
-    fclose(cartridge);
-
-    cartridge_t *cart = cartridge_load((uint8_t*)data);
-    gbc_mbc_init_with_cart(&gbc->mbc, cart);
-    gbc->mbc.rom_banks = data;
+    WRITE_R16(&gbc->cpu, REG_PC, 0x0100);
 
-    if (!cart) {
-        LOG_ERROR("Failed to load cartridge\n");
-        return 1;
+    /* https://gbdev.io/pandocs/The_Cartridge_Header.html#0143--cgb-flag */
+    if (!(rom->cart->cart_cgb_flag & 0x80)) {
+        gbc->mem.dmg = 1;
+        /* register A is how the games tell the models apart */
+        WRITE_R8(&gbc->cpu, REG_A, 0x01);
+        LOG_INFO("DMG mode\n");
     }
 
-    WRITE_R16(&gbc->cpu, REG_PC, 0x0100);
-
     /* initial values https://gbdev.io/pandocs/Power_Up_Sequence.html  */
     IO_PORT_WRITE(&(gbc->mem), IO_PORT_LCDC, 0x91);
 
@@ -75,55 +119,407 @@ gbc_init(gbc_t *gbc, const char *game_rom, const char *boot_rom)
 
     gbc->running = 1;
     gbc->paused = 0;
+    gbc->pacing = GBC_PACING_SLEEP;
+    gbc->speed = 1;
+}
+
+int
+gbc_init(gbc_t *gbc, const char *game_rom, const char *boot_rom)
+{
+    /* instances running the same game share the image, see rom_cache.h */
+    gbc_rom_t *rom = gbc_rom_acquire(game_rom);
+    if (!rom)
+        return 1;
+
+    gbc_setup(gbc, rom, boot_rom, NULL);
     return 0;
 }
 
+size_t
+gbc_sizeof(cartridge_t *cart)
+{
+    gbc_layout_t layout;
+    gbc_layout(cart, &layout);
+    return layout.size;
+}
+
+gbc_t*
+gbc_create(const char *game_rom, const char *boot_rom, void *memory, size_t size)
+{
+    gbc_rom_t *rom = gbc_rom_acquire(game_rom);
+    if (!rom)
+        return NULL;
+
+    size_t needed = gbc_sizeof(rom->cart);
+    void *allocation = NULL;
+
+    if (!memory) {
+        allocation = malloc_memory(needed + GBC_ARENA_ALIGN);
+        if (!allocation) {
+            LOG_ERROR("Failed to allocate memory\n");
+            gbc_rom_release(rom);
+            return NULL;
+        }
+        memory = (void*)(((uintptr_t)allocation + GBC_ARENA_ALIGN - 1) & ~(uintptr_t)(GBC_ARENA_ALIGN - 1));
+    } else if (size < needed || ((uintptr_t)memory & (GBC_ARENA_ALIGN - 1))) {
+        LOG_ERROR("An instance needs %zu bytes aligned to %d, got %zu bytes at %p\n",
+            needed, GBC_ARENA_ALIGN, size, memory);
+        gbc_rom_release(rom);
+        return NULL;
+    }
+
+    gbc_t *gbc = (gbc_t*)memory;
+    gbc_setup(gbc, rom, boot_rom, (uint8_t*)memory);
+    gbc->arena = allocation;
+    return gbc;
+}
+
+int
+gbc_attach_sav(gbc_t *gbc, const char *game_rom)
+{
+    if (!gbc_mbc_sav_size(&gbc->mbc))
+        return 0;
+
+    /* game.gbc -> game.sav */
+    size_t len = strlen(game_rom);
+    char *path = (char*)malloc_memory(len + 5);
+    if (!path) {
+        LOG_ERROR("Failed to allocate memory\n");
+        return 1;
+    }
+    strcpy(path, game_rom);
+
+    char *ext = strrchr(path, '.');
+    if (!ext || strchr(ext, '/') || strchr(ext, '\\'))
+        ext = path + len;
+    strcpy(ext, ".sav");
+
+    int ret = gbc_mbc_attach_sav(&gbc->mbc, path);
+    free_memory(path);
+    return ret;
+}
+
 void
-gbc_run(gbc_t *gbc)
+gbc_destroy(gbc_t *gbc)
 {
-    uint64_t lastf = get_time(), now = 0, delta = 0;
-    uint64_t cycles = 0;
+    gbc_mbc_destroy(&gbc->mbc);
+    gbc_rom_release(gbc->mbc.rom);
+    gbc->mbc.rom = NULL;
+    gbc->mbc.rom_banks = NULL;
+    gbc->mbc.cart = NULL;
+
+    if (gbc->owns_buffers) {
+        free_memory(gbc->cpu.blocks);
+        free_memory(gbc->graphic.framebuffer_memory);
+    }
+    gbc->cpu.blocks = NULL;
+    gbc->graphic.framebuffer_memory = NULL;
+    gbc->graphic.framebuffers[0] = gbc->graphic.framebuffers[1] = NULL;
+
+    /* the gbc_t is part of it */
+    free_memory(gbc->arena);
+}
+
+/* Brings the timer, ppu and io up to the given cpu cycle, the audio catches up on its own */
+static void
+gbc_sync(gbc_t *gbc, uint64_t cycles)
+{
+    gbc_scheduler_t *sched = &gbc->sched;
+
+    if (cycles <= sched->cycles)
+        return;
+
+    uint64_t clocks = gbc_scheduler_clocks_at(sched, cycles);
+    uint64_t start_clocks = sched->clocks;
+
+    /* neither looks at the other, they can run in one go */
+    gbc_graphic_run_cycles(&gbc->graphic, clocks - start_clocks);
+    gbc_timer_run_cycles(&gbc->timer, cycles - sched->cycles);
+    sched->cycles = cycles;
+    sched->clocks = clocks;
+
+    /* keypad and serial only have to be up to date when the cpu looks at them */
+    if (clocks > start_clocks)
+        gbc_io_cycle(&gbc->io);
+}
+
+/* the cpu is about to access something the other components can observe */
+static void
+gbc_mem_sync(void *udata, uint8_t write)
+{
+    gbc_t *gbc = (gbc_t*)udata;
+
+    if (gbc->sched.lockstep)
+        return;
+
+    /* the current instruction runs at cpu.cycles, the components catch up to the cycle before it */
+    gbc_sync(gbc, gbc->cpu.cycles - 1);
+
+    if (write)
+        gbc->sched.dirty = 1;
+}
+
+/*
+  The audio frame sequencer steps when DIV bit 4 (bit 5 in double speed) falls.
+  DIV just counts along with the cpu, the steps are known in advance until the
+  cpu resets it or switches the speed, the counter is checked for that here.
+*/
+static void
+gbc_schedule_frame_sequencer(gbc_t *gbc)
+{
+    gbc_scheduler_t *sched = &gbc->sched;
+    gbc_timer_t *timer = &gbc->timer;
+    gbc_audio_t *audio = &gbc->audio;
+
+    uint8_t div = *timer->divp;
+    uint16_t counter = (div << 8) | timer->div_cycles;
+    uint8_t mask = (IO_PORT_READ(&gbc->mem, IO_PORT_KEY1) & 0x80) ? 0x20 : 0x10;
+    /* the steps are in clocks, they move with the speed as well */
+    uint8_t mode = mask | sched->dspeed;
+    uint8_t div_before;
+
+    if (audio->frame_sequencer_clocks != AUDIO_FRAME_SEQUENCER_UNKNOWN) {
+        uint16_t counted = audio->frame_sequencer_counter + (sched->cycles - audio->frame_sequencer_cycles);
+        if (counted == counter && audio->frame_sequencer_mode == mode)
+            return;
+        /* it happened in the instruction that just ran, the steps before it still hold */
+        gbc_audio_sync(audio, sched->clocks);
+        div_before = counted >> 8;
+    } else {
+        /* after a load or the lockstep frames */
+        div_before = audio->div_apu;
+    }
+
+    /* a reset while the bit is set is a falling edge too */
+    if ((div_before & mask) && !(div & mask))
+        gbc_audio_frame_sequencer_step(audio);
+
+    /*
+      the cycle DIV ticks over to a multiple of (mask << 1), the audio notices
+      it the clock before, as it did when it ran along with the timer
+    */
+    uint64_t ticks = (mask << 1) - (div & ((mask << 1) - 1));
+    uint64_t tick = sched->cycles + (TICK_DIVIDER - timer->div_cycles) + (ticks - 1) * TICK_DIVIDER;
+
+    audio->frame_sequencer_clocks = gbc_scheduler_clocks_at(sched, tick - 1);
+    audio->frame_sequencer_cycles = sched->cycles;
+    audio->frame_sequencer_counter = counter;
+    audio->frame_sequencer_mode = mode;
+    audio->div_apu = div;
+}
+
+static void
+gbc_schedule(gbc_t *gbc)
+{
+    gbc_scheduler_t *sched = &gbc->sched;
+    uint64_t overflow = gbc_timer_next_overflow(&gbc->timer);
+
+    gbc_scheduler_add(sched, EVENT_FRAME, gbc_scheduler_cycles_at(sched, sched->frame_end));
+    gbc_scheduler_add(sched, EVENT_PPU,
+        gbc_scheduler_cycles_at(sched, sched->clocks + gbc->graphic.dots + 1));
+
+    if (overflow == UINT64_MAX)
+        gbc_scheduler_remove(sched, EVENT_TIMER);
+    else
+        gbc_scheduler_add(sched, EVENT_TIMER, sched->cycles + overflow);
+
+    gbc_schedule_frame_sequencer(gbc);
+    sched->dirty = 0;
+}
+
+/*
+  Runs a logic frame.
+  The cpu executes whole instructions until it reaches the next event (ppu mode
+  transition, TIMA overflow or the end of the frame), the interrupt flags can not
+  change before that. Everything else catches up in bulk, either at the events
+  or when the cpu touches their registers, see gbc_mem_sync.
+*/
+static void
+gbc_run_frame(gbc_t *gbc)
+{
+    gbc_cpu_t *cpu = &gbc->cpu;
+    gbc_scheduler_t *sched = &gbc->sched;
+
+    sched->frame_end = sched->clocks + CYCLES_PER_FRAME;
+    gbc_schedule(gbc);
 
     for (;;) {
+        uint64_t deadline = gbc_scheduler_next(sched);
 
-        now = get_time();
+        /* cpu.cycles + cpu.ins_cycles is the cycle the next instruction starts after */
+        while (cpu->cycles + cpu->ins_cycles < deadline) {
+            cpu->cycles += cpu->ins_cycles;
+            cpu->ins_cycles = 0;
 
-        if (now - lastf < FRAME_INTERVAL)
-            continue;
+            if (cpu->halt && !cpu->ime_insts && !(cpu->ier & *cpu->ifp & INTERRUPT_MASK)) {
+                /* nothing can wake it up before the deadline */
+                cpu->cycles = deadline;
+                break;
+            }
 
-        lastf = now;
+            gbc_cpu_cycle(cpu);
 
-        if (!gbc->running)
-            break;
+            if (cpu->dspeed != sched->dspeed) {
+                /* speed switch, the clocks after this instruction run at the new speed */
+                gbc_sync(gbc, cpu->cycles - 1);
+                gbc_scheduler_set_speed(sched, cpu->dspeed);
+                gbc_schedule(gbc);
+                deadline = gbc_scheduler_next(sched);
+            } else if (sched->dirty) {
+                gbc_schedule(gbc);
+                deadline = gbc_scheduler_next(sched);
+            }
+        }
+
+        uint64_t now = cpu->cycles + cpu->ins_cycles;
+        uint64_t frame_end = gbc_scheduler_cycles_at(sched, sched->frame_end);
+
+        if (frame_end <= now) {
+            /* the rest of the current instruction carries over to the next frame */
+            gbc_sync(gbc, frame_end);
+            cpu->cycles = frame_end;
+            cpu->ins_cycles = now - frame_end;
+            /* the frontend gets the samples of the whole frame */
+            gbc_audio_sync(&gbc->audio, sched->clocks);
+            return;
+        }
+
+        gbc_sync(gbc, now);
+        gbc_schedule(gbc);
+    }
+}
 
-        int frame_cycles = CYCLES_PER_FRAME;
-
-        while (frame_cycles--) {
-            cycles = gbc->cpu.cycles;
-            if (gbc->paused) {
-                if (gbc->debug_steps == 0) {
-                    continue;
-                }
-                /* forwards an instruction */
-                /* TODO: in double speed mode, this is not always a single instruction */
-                if (gbc->debug_steps > 0 && gbc->cpu.ins_cycles <= 1) {
-                    gbc->debug_steps--;
-                }
+/* ticks every component each clock, used by the debugger to step instructions */
+static void
+gbc_run_frame_lockstep(gbc_t *gbc)
+{
+    gbc_scheduler_t *sched = &gbc->sched;
+    int frame_cycles = CYCLES_PER_FRAME;
+
+    sched->lockstep = 1;
+
+    while (frame_cycles--) {
+        if (gbc->paused) {
+            if (gbc->debug_steps == 0) {
+                continue;
             }
+            /* forwards an instruction */
+            /* TODO: in double speed mode, this is not always a single instruction */
+            if (gbc->debug_steps > 0 && gbc->cpu.ins_cycles <= 1) {
+                gbc->debug_steps--;
+            }
+        }
 
+        gbc_cpu_cycle(&gbc->cpu);
+        gbc_timer_cycle(&gbc->timer);
+        if (gbc->cpu.dspeed) {
+            /* double speed mode */
             gbc_cpu_cycle(&gbc->cpu);
             gbc_timer_cycle(&gbc->timer);
-            if (gbc->cpu.dspeed) {
-                /* double speed mode */
-                gbc_cpu_cycle(&gbc->cpu);
-                gbc_timer_cycle(&gbc->timer);
-            }
-            gbc_graphic_cycle(&gbc->graphic);
-            gbc_io_cycle(&gbc->io);
-            gbc_audio_cycle(&gbc->audio);
         }
+        gbc_graphic_cycle(&gbc->graphic);
+        gbc_io_cycle(&gbc->io);
+        gbc_audio_cycle(&gbc->audio);
+        sched->clocks++;
+    }
+
+    sched->lockstep = 0;
+    sched->cycles = gbc->cpu.cycles;
+    gbc->audio.frame_sequencer_clocks = AUDIO_FRAME_SEQUENCER_UNKNOWN;
+    gbc_scheduler_set_speed(sched, gbc->cpu.dspeed);
+}
 
-        gbc->graphic.screen_update(&gbc->graphic);
-        gbc->audio.audio_update(&gbc->audio);
+/* runs a single logic frame as fast as it can and hands it to the frontend */
+void
+gbc_frame(gbc_t *gbc)
+{
+    if (gbc->rewind && !gbc->paused) {
+        if (!gbc->rewinding) {
+            gbc_rewind_push(gbc->rewind, gbc);
+        } else if (gbc_rewind_pop(gbc->rewind, gbc) != 0) {
+            /* out of history, keep showing the oldest frame */
+            gbc->graphic.screen_update(&gbc->graphic);
+            return;
+        }
+    }
+
+    /* the queue is at its lowest right before the frame adds to it */
+    gbc_audio_rate_control(&gbc->audio);
+
+    if (gbc->paused)
+        gbc_run_frame_lockstep(gbc);
+    else
+        gbc_run_frame(gbc);
+
+    gbc->graphic.screen_update(&gbc->graphic);
+    gbc_audio_flush(&gbc->audio);
+    gbc->audio.audio_update(&gbc->audio);
+
+    if (gbc->mbc.flush_interval && ++gbc->mbc.flush_frames >= gbc->mbc.flush_interval)
+        gbc_mbc_flush(&gbc->mbc);
+}
+
+/* can be called from the frontend while gbc_run is running, it takes effect from the next frame */
+void
+gbc_set_pacing(gbc_t *gbc, uint8_t pacing, float speed)
+{
+    if (pacing > GBC_PACING_TURBO || speed < 0) {
+        LOG_ERROR("Invalid pacing %d speed %f\n", pacing, speed);
+        return;
+    }
+
+    gbc->pacing = pacing;
+    gbc->speed = speed;
+}
+
+/* sleeps until the frame is due, next is when the frame after it will be */
+static void
+gbc_pace(uint64_t *next, uint64_t interval)
+{
+    sleep_until(*next);
+
+    /* do not try to catch up when we are far behind (e.g. the process was stopped), it just stalls the frontend */
+    uint64_t now = get_time();
+    if (now > *next + interval * 4)
+        *next = now;
+
+    *next += interval;
+}
+
+void
+gbc_run(gbc_t *gbc)
+{
+    gbc_audio_t *audio = &gbc->audio;
+    uint64_t next = get_time();
+
+    while (gbc->running) {
+        uint8_t pacing = gbc->pacing;
+
+        /* a paused cpu does not produce any audio, neither does a rewind that ran out of history */
+        if (pacing == GBC_PACING_AUDIO && (gbc->paused || gbc->rewinding || !audio->audio_queued))
+            pacing = GBC_PACING_SLEEP;
+
+        switch (pacing) {
+        case GBC_PACING_AUDIO:
+            /* the audio device is the clock, wait until it is about to run out of samples */
+            while (gbc->running && audio->audio_queued(audio) >= GBC_AUDIO_SAMPLE_SIZE * GBC_PACING_AUDIO_FRAMES)
+                sleep_until(get_time() + 1000000);
+            next = get_time();
+            break;
+        case GBC_PACING_TURBO:
+            if (gbc->speed > 0)
+                gbc_pace(&next, (uint64_t)(FRAME_INTERVAL / gbc->speed));
+            else
+                next = get_time();
+            break;
+        default:
+            gbc_pace(&next, FRAME_INTERVAL);
+            break;
+        }
+
+        if (!gbc->running)
+            break;
+
+        gbc_frame(gbc);
     }
-}
\ No newline at end of file
+}
@@ -8,8 +8,24 @@
 #include "graphic.h"
 #include "timer.h"
 #include "audio.h"
+#include "scheduler.h"
+#ifdef GBC_STATIC_MEMORY
+#include "block_cache.h"
+#endif
 
 typedef struct gbc gbc_t;
+typedef struct gbc_rewind gbc_rewind_t;
+
+/* how gbc_run keeps the emulation at the real speed */
+#define GBC_PACING_SLEEP    0       /* sleeps until the next frame is due */
+#define GBC_PACING_AUDIO    1       /* runs a frame whenever the audio queue runs low */
+#define GBC_PACING_TURBO    2       /* sleeps at speed times the real speed, 0 is uncapped */
+
+/* frames of audio the frontend should keep queued in GBC_PACING_AUDIO */
+#define GBC_PACING_AUDIO_FRAMES 2
+
+/* gbc_create lays out the instance and its buffers in one block, each part is aligned to this */
+#define GBC_ARENA_ALIGN 64
 
 struct gbc {
     gbc_cpu_t cpu;
@@ -19,13 +35,47 @@ struct gbc {
     gbc_graphic_t graphic;
     gbc_timer_t timer;
     gbc_audio_t audio;
+    gbc_scheduler_t sched;
 
     uint32_t debug_steps;
+    uint8_t pacing;
+    float speed;                    /* GBC_PACING_TURBO only */
+    gbc_rewind_t *rewind;           /* optional, see rewind.h */
+
     volatile uint8_t running:1;
     volatile uint8_t paused:1;
+    volatile uint8_t rewinding:1;   /* steps back through gbc->rewind instead of running forward */
+
+    uint8_t owns_buffers:1;         /* the block cache and the frame buffers are malloc'ed */
+    void *arena;                    /* malloc'ed by gbc_create, the instance lives in it */
+
+#ifdef GBC_STATIC_MEMORY
+    /*
+      For the bare-metal RPi target, there is no malloc, so the buffers are part
+      of gbc_t and the external RAM is sized for the largest cartridge.
+    */
+    gbc_block_cache_t static_blocks;
+    uint8_t static_framebuffers[FRAMEBUFFER_MEMORY_SIZE];
+    uint8_t static_ram[MAX_RAM_BANKS * RAM_BANK_SIZE];
+#endif
 };
 
 int gbc_init(gbc_t *gbc, const char *game_rom, const char *boot_rom);
+/* bytes gbc_create needs for an instance running the cartridge */
+size_t gbc_sizeof(cartridge_t *cart);
+/*
+  Same as gbc_init but the gbc_t, the block cache, the frame buffers and the
+  external RAM (only as much as the cartridge has) are laid out in one block of
+  memory, gbc_sizeof bytes aligned to GBC_ARENA_ALIGN, so hosts can pool them.
+  memory NULL mallocs it. Returns NULL on failure.
+*/
+gbc_t* gbc_create(const char *game_rom, const char *boot_rom, void *memory, size_t size);
+/* keeps the external RAM of a battery backed cartridge in a .sav next to it, it should be called right after gbc_init */
+int gbc_attach_sav(gbc_t *gbc, const char *game_rom);
+/* flushes the .sav and releases the cartridge and the buffers gbc_init/gbc_create allocated, not gbc->rewind */
+void gbc_destroy(gbc_t *gbc);
 void gbc_run(gbc_t *gbc);
+void gbc_frame(gbc_t *gbc);
+void gbc_set_pacing(gbc_t *gbc, uint8_t pacing, float speed);
 
 #endif
\ No newline at end of file
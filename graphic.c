@@ -6,9 +6,91 @@ static void* vram_addr(void *udata, uint16_t addr);
 static void* vram_addr_bank(void *udata, uint16_t addr, uint8_t bank);
 
 void
-gbc_graphic_init(gbc_graphic_t *graphic)
+gbc_graphic_init(gbc_graphic_t *graphic, void *framebuffer_memory)
 {
     memset(graphic, 0, sizeof(gbc_graphic_t));
+
+    graphic->framebuffer_memory = framebuffer_memory ? framebuffer_memory : malloc_memory(FRAMEBUFFER_MEMORY_SIZE);
+    if (!graphic->framebuffer_memory) {
+        LOG_ERROR("[GRAPHIC] Failed to allocate frame buffers\n");
+        abort();
+    }
+
+    uintptr_t base = ((uintptr_t)graphic->framebuffer_memory + FRAMEBUFFER_ALIGN - 1) & ~(uintptr_t)(FRAMEBUFFER_ALIGN - 1);
+    graphic->framebuffers[0] = (uint8_t*)base;
+    graphic->framebuffers[1] = (uint8_t*)base + FRAMEBUFFER_MAX_SIZE;
+    memset(graphic->framebuffers[0], 0, FRAMEBUFFER_MAX_SIZE * 2);
+
+    graphic->dmg_shades[0] = DMG_SHADE_0;
+    graphic->dmg_shades[1] = DMG_SHADE_1;
+    graphic->dmg_shades[2] = DMG_SHADE_2;
+    graphic->dmg_shades[3] = DMG_SHADE_3;
+
+    gbc_graphic_set_format(graphic, GBC_PIXEL_RGB555, 0);
+}
+
+/* the frontend should call it before the first frame, the buffers are cleared */
+void
+gbc_graphic_set_format(gbc_graphic_t *graphic, uint8_t pixel_format, uint8_t double_buffered)
+{
+    if (pixel_format > GBC_PIXEL_RGBA8888) {
+        LOG_ERROR("[GRAPHIC] Invalid pixel format %d\n", pixel_format);
+        abort();
+    }
+
+    graphic->pixel_format = pixel_format;
+    graphic->double_buffered = double_buffered ? 1 : 0;
+    graphic->front = 0;
+    memset(graphic->framebuffers[0], 0, FRAMEBUFFER_MAX_SIZE * 2);
+}
+
+/* the last complete frame (or the one in progress without double buffering), in the chosen pixel format */
+const void*
+gbc_graphic_frame(gbc_graphic_t *graphic)
+{
+    return graphic->framebuffers[graphic->front];
+}
+
+inline static uint8_t*
+gbc_graphic_back_buffer(gbc_graphic_t *graphic)
+{
+    return graphic->framebuffers[graphic->double_buffered ? !graphic->front : graphic->front];
+}
+
+/* converts a line of CGB colors into the frame buffer */
+static void*
+gbc_graphic_write_line(gbc_graphic_t *graphic, uint16_t scanline, const uint16_t *colors)
+{
+    uint8_t *buffer = gbc_graphic_back_buffer(graphic);
+
+    switch (graphic->pixel_format) {
+    case GBC_PIXEL_RGB565: {
+        uint16_t *line = (uint16_t*)buffer + scanline * VISIBLE_HORIZONTAL_PIXELS;
+        for (int i = 0; i < VISIBLE_HORIZONTAL_PIXELS; i++) {
+            uint16_t c = colors[i];
+            uint16_t g = (c >> 5) & 0x1F;
+            /* the 6th bit of green repeats its top bit, so white stays white */
+            line[i] = ((c & 0x1F) << 11) | (g << 6) | ((g >> 4) << 5) | ((c >> 10) & 0x1F);
+        }
+        return line;
+    }
+    case GBC_PIXEL_RGBA8888: {
+        uint8_t *line = buffer + scanline * VISIBLE_HORIZONTAL_PIXELS * 4;
+        for (int i = 0; i < VISIBLE_HORIZONTAL_PIXELS; i++) {
+            uint16_t c = colors[i];
+            line[i * 4] = GBC_COLOR_TO_RGB_R(c);
+            line[i * 4 + 1] = GBC_COLOR_TO_RGB_G(c);
+            line[i * 4 + 2] = GBC_COLOR_TO_RGB_B(c);
+            line[i * 4 + 3] = 0xff;
+        }
+        return line;
+    }
+    default: {
+        uint16_t *line = (uint16_t*)buffer + scanline * VISIBLE_HORIZONTAL_PIXELS;
+        memcpy(line, colors, VISIBLE_HORIZONTAL_PIXELS * sizeof(uint16_t));
+        return line;
+    }
+    }
 }
 
 gbc_tile_t*
@@ -58,21 +140,63 @@ gbc_graphic_get_tilemap(gbc_graphic_t *graphic, uint8_t type)
     return (gbc_tilemap_t*)vram_addr_bank(graphic, addr, 0);
 }
 
-inline static uint16_t
-gbc_graphic_render_pixel(gbc_graphic_t *graphic, uint16_t scanline, int16_t col, uint8_t *objs_idx, uint8_t objs_count)
+/*
+  Draws the background or the window from screen column col to the end of the line,
+  x and y are where col is in the 256x256 tilemap. Each tile row is fetched and decoded once, see tile.h.
+*/
+static void
+gbc_graphic_draw_tiles(gbc_graphic_t *graphic, uint8_t type, int16_t col, uint8_t x, uint8_t y,
+    uint16_t *colors, uint8_t *color_ids, uint8_t *priority)
 {
-    uint8_t lcdc = IO_PORT_READ(graphic->mem, IO_PORT_LCDC);
-    uint16_t bg_color, obj_color;
-    uint16_t tile_x, tile_y, x, y, tile_x_offset, tile_y_offset;
-    uint8_t attr, bg_color_id;
+    gbc_tilemap_t *tilemap = gbc_graphic_get_tilemap(graphic, type);
+    gbc_tilemap_attr_t *tilemap_attr = gbc_graphic_get_tilemap_attr(graphic, type);
+    uint8_t tile_y = y / TILE_SIZE;
+    uint8_t tile_y_offset = y % TILE_SIZE;
+    uint8_t ids[TILE_SIZE];
+    uint16_t tile_colors[TILE_SIZE];
+
+    while (col < VISIBLE_HORIZONTAL_PIXELS) {
+        uint8_t tile_x = x / TILE_SIZE;
+        uint8_t tile_x_offset = x % TILE_SIZE;
+        uint8_t attr = tilemap_attr->data[tile_y][tile_x];
+        gbc_tile_t *tile = gbc_graphic_get_tile(graphic, type, tilemap->data[tile_y][tile_x],
+                TILE_ATTR_VRAM_BANK(attr) ? 1 : 0);
+        uint8_t row = TILE_ATTR_YFLIP(attr) ? TILE_SIZE - tile_y_offset - 1 : tile_y_offset;
+        gbc_palette_t *palette = BG_PALETTE_READ(graphic->mem, TILE_ATTR_PALETTE(attr));
+        /* https://gbdev.io/pandocs/Tile_Maps.html#bg-to-obj-priority-in-cgb-mode */
+        uint8_t bg_priority = TILE_ATTR_PRIORITY(attr) ? 1 : 0;
+
+        uint8_t lo = tile->data[row * 2], hi = tile->data[row * 2 + 1];
+
+        gbc_tile_expand_row(lo, hi, TILE_ATTR_XFLIP(attr), palette->c, tile_colors, ids);
 
-    gbc_palette_t *palette;
-    gbc_tile_t *tile;
-    uint8_t bgwin_priority = 0;
+        /* x wraps around the tilemap by itself */
+        for (; tile_x_offset < TILE_SIZE && col < VISIBLE_HORIZONTAL_PIXELS; tile_x_offset++, col++, x++) {
+            color_ids[col] = ids[tile_x_offset];
+            colors[col] = tile_colors[tile_x_offset];
+            /* the window does not clear the priority of the background below it */
+            priority[col] |= bg_priority;
+        }
+    }
+}
+
+/*
+  Renders a whole scanline into a line buffer, background first, then the window
+  over it, then the objects, and writes it to the frame buffer at once.
+*/
+static void
+gbc_graphic_draw_line(gbc_graphic_t *graphic, uint16_t scanline)
+{
+    uint8_t lcdc = IO_PORT_READ(graphic->mem, IO_PORT_LCDC);
     uint8_t lcdc_bit0 = lcdc & LCDC_BG_ENABLE;
 
-    bg_color = obj_color = 0;
-    bg_color_id = 0;
+    uint16_t colors[VISIBLE_HORIZONTAL_PIXELS];
+    uint8_t color_ids[VISIBLE_HORIZONTAL_PIXELS];
+    uint8_t priority[VISIBLE_HORIZONTAL_PIXELS];
+
+    memset(colors, 0, sizeof(colors));
+    memset(color_ids, 0, sizeof(color_ids));
+    memset(priority, 0, sizeof(priority));
 
     if (lcdc_bit0) {
         /* background */
@@ -80,42 +204,13 @@ gbc_graphic_render_pixel(gbc_graphic_t *graphic, uint16_t scanline, int16_t col,
         "The scroll registers are re-read on each tile fetch, except for the low 3 bits of SCX" Does it matter?
         https://gbdev.io/pandocs/Scrolling.html#mid-frame-behavior
         */
-        uint16_t scroll_x = IO_PORT_READ(graphic->mem, IO_PORT_SCX);
-        uint16_t scroll_y = IO_PORT_READ(graphic->mem, IO_PORT_SCY);
-        gbc_tilemap_t *bg_tilemap = gbc_graphic_get_tilemap(graphic, TILE_TYPE_BG);
-        gbc_tilemap_attr_t *bg_tilemap_attr = gbc_graphic_get_tilemap_attr(graphic, TILE_TYPE_BG);
-
-        x = (scroll_x + col) % TILE_MAP_SIZE;
-        y = (scroll_y + scanline) % TILE_MAP_SIZE;
-
-        tile_x = x / TILE_SIZE;
-        tile_y = y / TILE_SIZE;
-
-        tile_x_offset = x % TILE_SIZE;
-        tile_y_offset = y % TILE_SIZE;
-
-        attr = bg_tilemap_attr->data[tile_y][tile_x];
-        tile = gbc_graphic_get_tile(graphic, TILE_TYPE_BG, bg_tilemap->data[tile_y][tile_x],
-                TILE_ATTR_VRAM_BANK(attr) ? 1 : 0);
-
-        if (TILE_ATTR_XFLIP(attr)) {
-            tile_x_offset = TILE_SIZE - tile_x_offset - 1;
-        }
-        if (TILE_ATTR_YFLIP(attr)) {
-            tile_y_offset = TILE_SIZE - tile_y_offset - 1;
-        }
-
-        bg_color_id = TILE_PIXEL_COLORID(tile, tile_x_offset, tile_y_offset);
-        palette = BG_PALETTE_READ(graphic->mem, TILE_ATTR_PALETTE(attr));
+        uint8_t scroll_x = IO_PORT_READ(graphic->mem, IO_PORT_SCX);
+        uint8_t scroll_y = IO_PORT_READ(graphic->mem, IO_PORT_SCY);
 
-        bg_color = palette->c[bg_color_id];
-
-        /* https://gbdev.io/pandocs/Tile_Maps.html#bg-to-obj-priority-in-cgb-mode */
-        if (TILE_ATTR_PRIORITY(attr))
-            bgwin_priority |= 1;
+        gbc_graphic_draw_tiles(graphic, TILE_TYPE_BG, 0, scroll_x, scroll_y + scanline,
+            colors, color_ids, priority);
     }
 
-    /* window */
     if (lcdc & LCDC_WINDOW_ENABLE) {
         /* TODO:
         we doesn't wait until WY and WX conditions are met
@@ -125,148 +220,226 @@ gbc_graphic_render_pixel(gbc_graphic_t *graphic, uint16_t scanline, int16_t col,
         uint8_t window_y = IO_PORT_READ(graphic->mem, IO_PORT_WY);
 
         /* notice that window_x and window_y are always positive */
-        if (scanline >= window_y && col >= window_x) {
-            gbc_tilemap_t *win_tilemap = gbc_graphic_get_tilemap(graphic, TILE_TYPE_WIN);
-            gbc_tilemap_attr_t *win_tilemap_attr = gbc_graphic_get_tilemap_attr(graphic, TILE_TYPE_WIN);
-
-            x = col - window_x;
-            y = scanline - window_y;
-
-            tile_x = x / TILE_SIZE;
-            tile_y = y / TILE_SIZE;
-
-            tile_x_offset = x % TILE_SIZE;
-            tile_y_offset = y % TILE_SIZE;
-
-            attr = win_tilemap_attr->data[tile_y][tile_x];
-            tile = gbc_graphic_get_tile(graphic, TILE_TYPE_WIN, win_tilemap->data[tile_y][tile_x],
-                    TILE_ATTR_VRAM_BANK(attr) ? 1 : 0);
-
-            if (TILE_ATTR_XFLIP(attr)) {
-                tile_x_offset = TILE_SIZE - tile_x_offset - 1;
-            }
-
-            if (TILE_ATTR_YFLIP(attr)) {
-                tile_y_offset = TILE_SIZE - tile_y_offset - 1;
-            }
-
-            bg_color_id = TILE_PIXEL_COLORID(tile, tile_x_offset, tile_y_offset);
-            palette = BG_PALETTE_READ(graphic->mem, TILE_ATTR_PALETTE(attr));
-
-            /* window has higher priority than background */
-            bg_color = palette->c[bg_color_id];
-
-            if (TILE_ATTR_PRIORITY(attr))
-                bgwin_priority |= 1;
+        if (scanline >= window_y && window_x < VISIBLE_HORIZONTAL_PIXELS) {
+            gbc_graphic_draw_tiles(graphic, TILE_TYPE_WIN, window_x, 0, scanline - window_y,
+                colors, color_ids, priority);
         }
     }
 
-    if (lcdc_bit0 && bg_color_id && bgwin_priority) {
-        return bg_color;
-    }
-
-    uint8_t obj_found = 0;
-
-    /* objs */
     if (lcdc & LCDC_OBJ_ENABLE) {
-        for (int i = 0; i < objs_count; i++) {
-            gbc_obj_t *obj = (gbc_obj_t*)OAM_ADDR(graphic->mem);
-            obj += objs_idx[i];
-
+        /* scan objs */
+        uint8_t obj_height = lcdc & LCDC_OBJ_SIZE ? OBJ_HEIGHT_2 : OBJ_HEIGHT;
+        uint8_t drawn[VISIBLE_HORIZONTAL_PIXELS];
+        uint8_t objs = 0;
+        gbc_obj_t *obj = (gbc_obj_t*)OAM_ADDR(graphic->mem);
+        int16_t signed_scanline = (int16_t)scanline;
+        uint8_t ids[TILE_SIZE];
+        uint16_t tile_colors[TILE_SIZE];
+
+        memset(drawn, 0, sizeof(drawn));
+
+        for (int i = 0; i < MAX_OBJS && objs < MAX_OBJ_SCANLINE; i++, obj++) {
             int16_t obj_y = OAM_Y_TO_SCREEN(obj->y);
             int16_t obj_x = OAM_X_TO_SCREEN(obj->x);
 
-            if (col < obj_x || col >= obj_x + OBJ_WIDTH) {
+            if (signed_scanline < obj_y || signed_scanline >= obj_y + obj_height)
                 continue;
-            }
 
+            objs++;
+
+            uint8_t attr = obj->attr;
             uint8_t tile_idx = obj->tile;
-            uint8_t tile_x_offset = col - obj_x;
             uint8_t tile_y_offset = scanline - obj_y;
 
             if (lcdc & LCDC_OBJ_SIZE) {
                 /* 8x16 */
-                if (scanline >= obj_y + OBJ_HEIGHT) {
+                if (signed_scanline >= obj_y + OBJ_HEIGHT) {
                     /* bottom tile */
                     tile_y_offset -= TILE_SIZE;
-                    tile_idx = OBJ_ATTR_YFLIP(obj->attr) ? (tile_idx & 0xFE) : (tile_idx | 0x01);
+                    tile_idx = OBJ_ATTR_YFLIP(attr) ? (tile_idx & 0xFE) : (tile_idx | 0x01);
                 } else {
                     /* top tile */
-                    tile_idx = OBJ_ATTR_YFLIP(obj->attr) ? (tile_idx | 0x01) : (tile_idx & 0xFE);
+                    tile_idx = OBJ_ATTR_YFLIP(attr) ? (tile_idx | 0x01) : (tile_idx & 0xFE);
                 }
             }
 
-            uint8_t attr = obj->attr;
-            gbc_tile_t *tile = gbc_graphic_get_tile(graphic, TILE_TYPE_OBJ, tile_idx,
-                OBJ_ATTR_VRAM_BANK(attr) ? 1 : 0);
-
-            if (OBJ_ATTR_XFLIP(attr)) {
-                tile_x_offset = TILE_SIZE - tile_x_offset - 1;
-            }
-
             if (OBJ_ATTR_YFLIP(attr)) {
                 tile_y_offset = TILE_SIZE - tile_y_offset - 1;
             }
 
-            assert(tile_x_offset >= 0 && tile_x_offset < TILE_SIZE);
+            gbc_tile_t *tile = gbc_graphic_get_tile(graphic, TILE_TYPE_OBJ, tile_idx,
+                OBJ_ATTR_VRAM_BANK(attr) ? 1 : 0);
+            gbc_palette_t *palette = OBJ_PALETTE_READ(graphic->mem, OBJ_ATTR_PALETTE(attr));
+            uint8_t obj_priority = OBJ_ATTR_BG_PRIORITY(attr) ? 1 : 0;
+
+            uint8_t lo = tile->data[tile_y_offset * 2], hi = tile->data[tile_y_offset * 2 + 1];
+
+            gbc_tile_expand_row(lo, hi, OBJ_ATTR_XFLIP(attr), palette->c, tile_colors, ids);
 
-            uint16_t color_id = TILE_PIXEL_COLORID(tile, tile_x_offset, tile_y_offset);
+            for (int j = 0; j < OBJ_WIDTH; j++) {
+                int16_t col = obj_x + j;
 
-            if (color_id == 0) {
                 /* color 0 means transparent */
-                continue;
+                if (col < 0 || col >= VISIBLE_HORIZONTAL_PIXELS || !ids[j])
+                    continue;
+
+                /*
+                the earlier(mem position in OAM) obj has higher priority
+                and gameboy doest have alpha channel, the first one wins the pixel
+                */
+                if (drawn[col])
+                    continue;
+                drawn[col] = 1;
+
+                if (!(priority[col] | obj_priority) || !color_ids[col] || !lcdc_bit0)
+                    colors[col] = tile_colors[j];
             }
-
-            gbc_palette_t *palette = OBJ_PALETTE_READ(graphic->mem, OBJ_ATTR_PALETTE(attr));
-            obj_color = palette->c[color_id];
-            if (OBJ_ATTR_BG_PRIORITY(attr))
-                bgwin_priority |= 1;
-            /*
-            the earlier(mem position in OAM) obj has higher priority
-            and gameboy doest have alpha channel, we can break here
-            */
-            obj_found = 1;
-            break;
         }
     }
 
-    if (obj_found && (!bgwin_priority || !bg_color_id || !lcdc_bit0)) {
-        return obj_color;
-    }
+    void *line = gbc_graphic_write_line(graphic, scanline, colors);
+    if (graphic->screen_line)
+        graphic->screen_line(graphic->screen_udata, scanline, line);
+}
 
-    return bg_color;
+/*
+  DMG mode, https://gbdev.io/pandocs/Palettes.html#lcd-monochrome-palettes
+  There is no attribute map, no VRAM bank 1 and the palettes are BGP/OBP0/OBP1,
+  so the tiles are fetched straight from bank 0.
+*/
+static inline void
+gbc_graphic_dmg_palette(gbc_graphic_t *graphic, uint8_t reg, uint16_t *palette)
+{
+    for (int i = 0; i < 4; i++)
+        palette[i] = graphic->dmg_shades[(reg >> (i * 2)) & 0x03];
 }
 
 static void
-gbc_graphic_draw_line(gbc_graphic_t *graphic, uint16_t scanline)
+gbc_graphic_draw_tiles_dmg(gbc_graphic_t *graphic, uint8_t type, int16_t col, uint8_t x, uint8_t y,
+    const uint16_t *palette, uint16_t *colors, uint8_t *color_ids)
 {
-    int16_t scanline_base = scanline * VISIBLE_HORIZONTAL_PIXELS;
+    gbc_tilemap_t *tilemap = gbc_graphic_get_tilemap(graphic, type);
+    uint8_t unsigned_data = IO_PORT_READ(graphic->mem, IO_PORT_LCDC) & LCDC_BG_WINDOW_TILE_DATA;
+    uint8_t tile_y = y / TILE_SIZE;
+    uint8_t row = (y % TILE_SIZE) * 2;
+    uint8_t ids[TILE_SIZE];
+    uint16_t tile_colors[TILE_SIZE];
+
+    while (col < VISIBLE_HORIZONTAL_PIXELS) {
+        uint8_t tile_x = x / TILE_SIZE;
+        uint8_t tile_x_offset = x % TILE_SIZE;
+        uint8_t idx = tilemap->data[tile_y][tile_x];
+        /* 0x8000 unsigned or 0x9000 signed */
+        const uint8_t *tile = graphic->vram + (unsigned_data ? idx * 16 : 0x1000 + (int8_t)idx * 16);
+        uint8_t lo = tile[row], hi = tile[row + 1];
+
+        gbc_tile_expand_row(lo, hi, 0, palette, tile_colors, ids);
+
+        for (; tile_x_offset < TILE_SIZE && col < VISIBLE_HORIZONTAL_PIXELS; tile_x_offset++, col++, x++) {
+            color_ids[col] = ids[tile_x_offset];
+            colors[col] = tile_colors[tile_x_offset];
+        }
+    }
+}
 
-    /* scan objs */
-    uint8_t objs = 0;
+static void
+gbc_graphic_draw_line_dmg(gbc_graphic_t *graphic, uint16_t scanline)
+{
     uint8_t lcdc = IO_PORT_READ(graphic->mem, IO_PORT_LCDC);
-    uint8_t obj_height = lcdc & LCDC_OBJ_SIZE ? OBJ_HEIGHT_2 : OBJ_HEIGHT;
+    uint16_t colors[VISIBLE_HORIZONTAL_PIXELS];
+    uint8_t color_ids[VISIBLE_HORIZONTAL_PIXELS];
+    uint16_t palette[4];
 
-    gbc_obj_t *obj = (gbc_obj_t*)OAM_ADDR(graphic->mem);
-    uint8_t objs_idx[MAX_OBJ_SCANLINE];
+    memset(color_ids, 0, sizeof(color_ids));
 
-    int16_t signed_scanline = (int16_t)scanline;
+    /* on the DMG bit 0 turns the background and the window off, the line is white */
+    if (lcdc & LCDC_BG_ENABLE) {
+        gbc_graphic_dmg_palette(graphic, IO_PORT_READ(graphic->mem, IO_PORT_BGP), palette);
 
-    for (int i = 0; i < MAX_OBJS; i++, obj++) {
-        int16_t y = OAM_Y_TO_SCREEN(obj->y);
+        uint8_t scroll_x = IO_PORT_READ(graphic->mem, IO_PORT_SCX);
+        uint8_t scroll_y = IO_PORT_READ(graphic->mem, IO_PORT_SCY);
+        gbc_graphic_draw_tiles_dmg(graphic, TILE_TYPE_BG, 0, scroll_x, scroll_y + scanline,
+            palette, colors, color_ids);
 
-        if (signed_scanline >= y && signed_scanline < y + obj_height) {
-            objs_idx[objs++] = i;
-            if (objs == MAX_OBJ_SCANLINE) {
-                break;
+        if (lcdc & LCDC_WINDOW_ENABLE) {
+            uint8_t window_x = IO_PORT_READ(graphic->mem, IO_PORT_WX) - 7;
+            uint8_t window_y = IO_PORT_READ(graphic->mem, IO_PORT_WY);
+
+            if (scanline >= window_y && window_x < VISIBLE_HORIZONTAL_PIXELS) {
+                gbc_graphic_draw_tiles_dmg(graphic, TILE_TYPE_WIN, window_x, 0, scanline - window_y,
+                    palette, colors, color_ids);
             }
         }
+    } else {
+        for (int i = 0; i < VISIBLE_HORIZONTAL_PIXELS; i++)
+            colors[i] = graphic->dmg_shades[0];
     }
 
-    for (int16_t i = 0; i < VISIBLE_HORIZONTAL_PIXELS; i++) {
-        uint16_t color = gbc_graphic_render_pixel(graphic, scanline, i, objs_idx, objs);
-        graphic->screen_write(graphic->screen_udata, scanline_base + i, color);
+    if (lcdc & LCDC_OBJ_ENABLE) {
+        uint8_t obj_height = lcdc & LCDC_OBJ_SIZE ? OBJ_HEIGHT_2 : OBJ_HEIGHT;
+        uint8_t drawn[VISIBLE_HORIZONTAL_PIXELS];
+        gbc_obj_t *objs[MAX_OBJ_SCANLINE];
+        uint8_t count = 0;
+        gbc_obj_t *obj = (gbc_obj_t*)OAM_ADDR(graphic->mem);
+        int16_t signed_scanline = (int16_t)scanline;
+        uint16_t obj_palettes[2][4];
+        uint8_t ids[TILE_SIZE];
+        uint16_t tile_colors[TILE_SIZE];
+
+        memset(drawn, 0, sizeof(drawn));
+        gbc_graphic_dmg_palette(graphic, IO_PORT_READ(graphic->mem, IO_PORT_OBP0), obj_palettes[0]);
+        gbc_graphic_dmg_palette(graphic, IO_PORT_READ(graphic->mem, IO_PORT_OBP1), obj_palettes[1]);
+
+        for (int i = 0; i < MAX_OBJS && count < MAX_OBJ_SCANLINE; i++, obj++) {
+            int16_t obj_y = OAM_Y_TO_SCREEN(obj->y);
+            if (signed_scanline < obj_y || signed_scanline >= obj_y + obj_height)
+                continue;
+
+            /* the smaller x wins, then the earlier one in OAM, the sort keeps the OAM order */
+            int j = count++;
+            for (; j > 0 && objs[j - 1]->x > obj->x; j--)
+                objs[j] = objs[j - 1];
+            objs[j] = obj;
+        }
+
+        for (int i = 0; i < count; i++) {
+            obj = objs[i];
+            int16_t obj_y = OAM_Y_TO_SCREEN(obj->y);
+            int16_t obj_x = OAM_X_TO_SCREEN(obj->x);
+            uint8_t attr = obj->attr;
+            uint8_t tile_idx = obj->tile;
+            uint8_t tile_y_offset = scanline - obj_y;
+
+            if (OBJ_ATTR_YFLIP(attr))
+                tile_y_offset = obj_height - tile_y_offset - 1;
+            if (lcdc & LCDC_OBJ_SIZE)
+                tile_idx &= 0xFE;
+
+            /* the 8x16 bottom tile follows the top one */
+            const uint8_t *tile = graphic->vram + tile_idx * 16 + tile_y_offset * 2;
+            uint8_t obj_priority = OBJ_ATTR_BG_PRIORITY(attr) ? 1 : 0;
+
+            gbc_tile_expand_row(tile[0], tile[1], OBJ_ATTR_XFLIP(attr),
+                obj_palettes[OBJ_ATTR_DMG_PALETTE(attr) ? 1 : 0], tile_colors, ids);
+
+            for (int j = 0; j < OBJ_WIDTH; j++) {
+                int16_t col = obj_x + j;
+
+                /* color 0 means transparent */
+                if (col < 0 || col >= VISIBLE_HORIZONTAL_PIXELS || !ids[j] || drawn[col])
+                    continue;
+                drawn[col] = 1;
+
+                /* behind the background colors 1-3 */
+                if (!obj_priority || !color_ids[col])
+                    colors[col] = tile_colors[j];
+            }
+        }
     }
+
+    void *line = gbc_graphic_write_line(graphic, scanline, colors);
+    if (graphic->screen_line)
+        graphic->screen_line(graphic->screen_udata, scanline, line);
 }
 
 void
@@ -295,7 +468,10 @@ gbc_graphic_cycle(gbc_graphic_t *graphic)
                 /* DRAWING */
                 graphic->dots = PPU_MODE_3_DOTS;
                 graphic->mode = PPU_MODE_3;
-                gbc_graphic_draw_line(graphic, scanline);
+                if (graphic->mem->dmg)
+                    gbc_graphic_draw_line_dmg(graphic, scanline);
+                else
+                    gbc_graphic_draw_line(graphic, scanline);
             } else if (graphic->mode == PPU_MODE_0 || graphic->mode == PPU_MODE_1) {
                 if (graphic->mode != PPU_MODE_1)
                     scanline++;
@@ -315,6 +491,9 @@ gbc_graphic_cycle(gbc_graphic_t *graphic)
                 }
                 REQUEST_INTERRUPT(graphic->mem, INTERRUPT_VBLANK);
                 graphic->mode = PPU_MODE_1;
+                /* the frame is complete */
+                if (graphic->double_buffered)
+                    graphic->front = !graphic->front;
             }
 
             graphic->dots = PPU_MODE_1_DOTS;
@@ -364,6 +543,18 @@ gbc_graphic_cycle(gbc_graphic_t *graphic)
     }
 }
 
+/* same as calling gbc_graphic_cycle n times, only the mode transitions do real work */
+void
+gbc_graphic_run_cycles(gbc_graphic_t *graphic, uint64_t n)
+{
+    while (n > graphic->dots) {
+        n -= graphic->dots + 1;
+        graphic->dots = 0;
+        gbc_graphic_cycle(graphic);
+    }
+    graphic->dots -= n;
+}
+
 inline static void*
 vram_addr_bank(void *udata, uint16_t addr, uint8_t bank)
 {
@@ -398,6 +589,15 @@ vram_write(void *udata, uint16_t addr, uint8_t data)
     return data;
 }
 
+static void
+vram_remap(void *udata)
+{
+    gbc_graphic_t *graphic = (gbc_graphic_t*)udata;
+    uint8_t *bank = vram_addr(udata, VRAM_BEGIN);
+    /* writes go through vram_write so the ppu can catch up before the line it draws changes */
+    map_memory_pages(graphic->mem, VRAM_BEGIN, VRAM_END, bank, NULL);
+}
+
 void
 gbc_graphic_connect(gbc_graphic_t *graphic, gbc_memory_t *mem)
 {
@@ -409,6 +609,7 @@ gbc_graphic_connect(gbc_graphic_t *graphic, gbc_memory_t *mem)
     entry.addr_end = VRAM_END;
     entry.read = vram_read;
     entry.write = vram_write;
+    entry.remap = vram_remap;
     entry.udata = graphic;
 
     register_memory_map(mem, &entry);
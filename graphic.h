@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "memory.h"
+#include "tile.h"
 
 typedef struct gbc_graphic gbc_graphic_t;
 typedef struct gbc_tile gbc_tile_t;
@@ -10,7 +11,7 @@ typedef struct gbc_tilemap gbc_tilemap_t;
 typedef struct gbc_tilemap_attr gbc_tilemap_attr_t;
 typedef struct gbc_obj gbc_obj_t;
 
-typedef void (*screen_write)(void *udata, uint16_t addr, uint16_t data);
+typedef void (*screen_line)(void *udata, uint8_t scanline, const void *pixels);
 
 #define VRAM_BANK_SIZE (VRAM_END-VRAM_BEGIN+1)
 
@@ -90,6 +91,16 @@ TODO: Using cpu cycles may be better?
 
 #define GBC_COLOR_TO_RGB(x) (GBC_COLOR_TO_RGB_R(x) << 10 | GBC_COLOR_TO_RGB_G(x) << 5 | GBC_COLOR_TO_RGB_B(x))
 
+/* pixel formats of the frame buffer, see gbc_graphic_set_format */
+#define GBC_PIXEL_RGB555    0       /* uint16_t, the CGB color as is, red in the low bits */
+#define GBC_PIXEL_RGB565    1       /* uint16_t, red in the high bits */
+#define GBC_PIXEL_RGBA8888  2       /* R, G, B, A bytes in memory order */
+
+#define FRAMEBUFFER_PIXELS (VISIBLE_HORIZONTAL_PIXELS * VISIBLE_VERTICAL_PIXELS)
+#define FRAMEBUFFER_MAX_SIZE (FRAMEBUFFER_PIXELS * 4)
+#define FRAMEBUFFER_ALIGN 64
+#define FRAMEBUFFER_MEMORY_SIZE (FRAMEBUFFER_MAX_SIZE * 2 + FRAMEBUFFER_ALIGN)    /* both buffers, aligned */
+
 #define MAX_OBJ_SCANLINE 10
 #define MAX_OBJS ((OAM_END - OAM_BEGIN + 1) / 4)
 
@@ -99,14 +110,17 @@ TODO: Using cpu cycles may be better?
 #define OBJ_ATTR_YFLIP(x) ((x) & 0x40)
 #define OBJ_ATTR_BG_PRIORITY(x) ((x) & 0x80)
 
+#define OBJ_ATTR_DMG_PALETTE(x) ((x) & 0x10)
+
+/* the DMG shades, lightest first, as RGB555 */
+#define DMG_SHADE_0 0x7fff
+#define DMG_SHADE_1 0x56b5
+#define DMG_SHADE_2 0x294a
+#define DMG_SHADE_3 0x0000
+
 #define OAM_Y_TO_SCREEN(y) ((y) - 16)
 #define OAM_X_TO_SCREEN(x) ((x) - 8)
 
-/* each tile is 8x8, top-left is 0,0 */
-#define TILE_PIXEL_COLORID(td, x, y)  \
-    ((td)->data[y * 2] & (1 << (7 - x)) ? 1 : 0) + \
-    ((td)->data[y * 2 + 1] & (1 << (7 - x)) ? 2 : 0)
-
 struct gbc_graphic
 {
     uint32_t dots;   /* dots to next graphic update */
@@ -114,9 +128,25 @@ struct gbc_graphic
     uint8_t scanline;
     uint8_t mode;
 
+    /*
+      The ppu renders into its own frame buffers, the frontend reads the front one
+      with gbc_graphic_frame in screen_update. With double buffering the lines go
+      to the back buffer and the buffers are swapped when a frame is complete,
+      otherwise there is a single buffer and the frontend may see a frame in progress.
+    */
+    uint8_t *framebuffers[2];
+    void *framebuffer_memory;
+    uint8_t front;
+    uint8_t pixel_format;
+    uint8_t double_buffered:1;
+
     void *screen_udata;
     void (*screen_update)(void *udata);
-    screen_write screen_write;
+    /* optional, called with every line as soon as it is drawn */
+    screen_line screen_line;
+
+    /* colors of the 4 shades in DMG mode (mem->dmg), the frontend may change them */
+    uint16_t dmg_shades[4];
 
     gbc_memory_t *mem;
 };
@@ -148,8 +178,12 @@ struct gbc_obj
 
 
 void gbc_graphic_connect(gbc_graphic_t *graphic, gbc_memory_t *mem);
-void gbc_graphic_init(gbc_graphic_t *graphic);
+/* framebuffer_memory is FRAMEBUFFER_MEMORY_SIZE bytes, NULL mallocs it */
+void gbc_graphic_init(gbc_graphic_t *graphic, void *framebuffer_memory);
 void gbc_graphic_cycle(gbc_graphic_t *graphic);
+void gbc_graphic_run_cycles(gbc_graphic_t *graphic, uint64_t n);
+void gbc_graphic_set_format(gbc_graphic_t *graphic, uint8_t pixel_format, uint8_t double_buffered);
+const void* gbc_graphic_frame(gbc_graphic_t *graphic);
 uint8_t* gbc_graphic_get_tile_attr(gbc_graphic_t *graphic, uint8_t type, uint8_t idx);
 gbc_tile_t* gbc_graphic_get_tile(gbc_graphic_t *graphic, uint8_t type, uint8_t idx, uint8_t bank);
 
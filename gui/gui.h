@@ -16,7 +16,7 @@ int GuiInit();
 /* destroy the GUI environment */
 void GuiDestroy();
 
-/* update the GUI, it will called after every frame */
+/* update the GUI, it will called after every frame, the screen is read from gbc_graphic_frame (RGBA8888) */
 void GuiUpdate();
 
 /* callback after close the GUI */
@@ -28,18 +28,25 @@ void GuiSetUserData(void *udata);
 /* it will be called after every frame, to see if any key is pressed */
 uint8_t GuiPollKeypad();
 
-/* Gameboy sound, left and right channel respectively */
-void GuiAudioWrite(int8_t l_sample, int8_t r_sample);
+/* Gameboy sound, n interleaved int16 stereo frames, left first */
+void GuiAudioWrite(const int16_t *frames, size_t n);
 
 /* update the audio, it will be called after every frame */
 void GuiAudioUpdate(void *udata);
 
-/*
-pixels of Gameboy screen will be written using this function,
-addr is the position of the pixel, left-top is 0, right-bottom is 159x143
-data is the RGB555 color data
-*/
-void GuiWrite(void *udata, unsigned short addr, unsigned short data);
+/* samples still waiting to be played, used by GBC_PACING_AUDIO */
+uint32_t GuiAudioQueued(void *udata);
+
+/* fill level of the audio ring, in stereo frames */
+typedef struct gui_audio_stats {
+    uint32_t fill;
+    uint32_t capacity;
+    uint32_t min_fill;      /* lowest fill since the previous call */
+    uint32_t underruns;     /* frames played as silence since the start */
+    uint32_t overruns;      /* frames dropped since the start */
+} gui_audio_stats_t;
+
+void GuiAudioGetStats(gui_audio_stats_t *stats);
 
 #ifdef __cplusplus
 }
@@ -14,7 +14,7 @@
 #include <unordered_map>
 #include <vector>
 #include <SDL.h>
-#include <thread>
+#include <atomic>
 #if defined(IMGUI_IMPL_OPENGL_ES2)
 #include <SDL_opengles2.h>
 #else
@@ -28,7 +28,10 @@
 using std::vector;
 
 #define SAMPLE_RATE GBC_AUDIO_SAMPLE_RATE  // Standard sample rate for audio
-#define SAMPLES_FRAME (2 * GBC_AUDIO_SAMPLE_SIZE)
+/* stereo frames the device asks for in one callback, about 12ms */
+#define DEVICE_SAMPLES 512
+/* stereo frames the ring holds, a power of two, about 186ms */
+#define RING_SAMPLES 8192
 
 void (*gui_close_callback)(void* udata) = NULL;
 void *gui_callback_udata = NULL;
@@ -36,9 +39,27 @@ void *gui_callback_udata = NULL;
 static uint8_t key_pressed = 0;
 static SDL_Window* window;
 static SDL_GLContext gl_context;
-static vector<int8_t> audio_buffer(SAMPLES_FRAME * 2);  // Buffer for audio samples
 SDL_AudioDeviceID audio_device;
-static int sample_counter = 0;
+
+/*
+  Single producer (the emulator thread, GuiAudioWrite) single consumer (the SDL
+  audio thread, AudioCallback) ring of stereo frames. The positions only grow
+  and wrap at 2^32, each side only stores its own, so neither side ever takes a
+  lock or waits for the other: a full ring drops the new samples, an empty one
+  plays silence.
+*/
+struct AudioRing {
+    int16_t samples[RING_SAMPLES * 2];
+    std::atomic<uint32_t> write_pos;
+    std::atomic<uint32_t> read_pos;
+
+    /* telemetry, in stereo frames */
+    std::atomic<uint32_t> underruns;    /* frames the device played as silence */
+    std::atomic<uint32_t> overruns;     /* frames dropped on a full ring */
+    std::atomic<uint32_t> min_fill;     /* lowest fill seen by the callback since the last GuiAudioGetStats */
+};
+
+static AudioRing audio_ring;
 
 // This example can also compile and run with Emscripten! See 'Makefile.emscripten' for details.
 #ifdef __EMSCRIPTEN__
@@ -62,6 +83,13 @@ static std::unordered_map<int, SDL_Keycode> key_map = {
 
 void HandleKeyPress(SDL_Keycode key, int action)
 {
+    if (key == SDLK_BACKSPACE) {
+        /* hold to rewind */
+        gbc_t *gbc = (gbc_t*)gui_callback_udata;
+        gbc->rewinding = action == SDL_KEYDOWN;
+        return;
+    }
+
     key_pressed = 0;
     auto kiter = key_map.find(key);
     if (kiter == key_map.end()) {
@@ -72,63 +100,79 @@ void HandleKeyPress(SDL_Keycode key, int action)
         key_pressed = kiter->second;
 }
 
-void AudioThread()
+static void AudioCallback(void *udata, Uint8 *stream, int len)
+{
+    AudioRing *ring = (AudioRing*)udata;
+    int16_t *out = (int16_t*)stream;
+    uint32_t wanted = len / (2 * sizeof(int16_t));
+    uint32_t read_pos = ring->read_pos.load(std::memory_order_relaxed);
+    /* acquire pairs with the release in GuiAudioWrite, the samples before write_pos are visible */
+    uint32_t fill = ring->write_pos.load(std::memory_order_acquire) - read_pos;
+    uint32_t n = fill < wanted ? fill : wanted;
+
+    /* at most two runs, before and after the wrap */
+    uint32_t first = read_pos & (RING_SAMPLES - 1);
+    uint32_t run = n < RING_SAMPLES - first ? n : RING_SAMPLES - first;
+    memcpy(out, ring->samples + first * 2, run * 2 * sizeof(int16_t));
+    memcpy(out + run * 2, ring->samples, (n - run) * 2 * sizeof(int16_t));
+    /* AUDIO_S16SYS silence */
+    memset(out + n * 2, 0, (wanted - n) * 2 * sizeof(int16_t));
+
+    ring->read_pos.store(read_pos + n, std::memory_order_release);
+
+    if (n < wanted)
+        ring->underruns.fetch_add(wanted - n, std::memory_order_relaxed);
+    if (fill < ring->min_fill.load(std::memory_order_relaxed))
+        ring->min_fill.store(fill, std::memory_order_relaxed);
+}
+
+void InitAudio()
 {
     SDL_AudioSpec desired_spec, obtained_spec;
+    SDL_zero(desired_spec);
     desired_spec.freq = SAMPLE_RATE;
-    desired_spec.format = AUDIO_S8;
+    desired_spec.format = AUDIO_S16SYS;
     desired_spec.channels = 2;
-    desired_spec.samples = SAMPLES_FRAME;
-    desired_spec.callback = NULL;
-
-    if ((audio_device = SDL_OpenAudioDevice(NULL, 0, &desired_spec, &obtained_spec, 0)) < 0) {
+    desired_spec.samples = DEVICE_SAMPLES;
+    desired_spec.callback = AudioCallback;
+    desired_spec.userdata = &audio_ring;
+
+    audio_ring.write_pos = 0;
+    audio_ring.read_pos = 0;
+    audio_ring.underruns = 0;
+    audio_ring.overruns = 0;
+    audio_ring.min_fill = UINT32_MAX;
+
+    /* SDL converts whatever the device wants, the callback always sees S16 stereo */
+    if ((audio_device = SDL_OpenAudioDevice(NULL, 0, &desired_spec, &obtained_spec, 0)) == 0) {
         fprintf(stderr, "Failed to open audio: %s\n", SDL_GetError());
         return;
     }
 
     SDL_PauseAudioDevice(audio_device, 0);  // Start playing audio
-    while (true) {
-        SDL_Delay(1000);
-    }
-
-    SDL_CloseAudioDevice(audio_device);
-    return;
 }
 
-void GuiAudioWrite(int8_t l_sample, int8_t r_sample)
+void GuiAudioWrite(const int16_t *frames, size_t count)
 {
-    if (sample_counter >= audio_buffer.size()) {
-        return;
-    }
-
-    audio_buffer[sample_counter++] = l_sample;
-    audio_buffer[sample_counter++] = r_sample;
+    AudioRing *ring = &audio_ring;
+    uint32_t write_pos = ring->write_pos.load(std::memory_order_relaxed);
+    uint32_t space = RING_SAMPLES - (write_pos - ring->read_pos.load(std::memory_order_acquire));
+    uint32_t n = count < space ? (uint32_t)count : space;
+
+    if (n < count)
+        ring->overruns.fetch_add((uint32_t)count - n, std::memory_order_relaxed);
+
+    /* the whole batch is published with a single store */
+    uint32_t first = write_pos & (RING_SAMPLES - 1);
+    uint32_t run = n < RING_SAMPLES - first ? n : RING_SAMPLES - first;
+    memcpy(ring->samples + first * 2, frames, run * 2 * sizeof(int16_t));
+    memcpy(ring->samples, frames + run * 2, (n - run) * 2 * sizeof(int16_t));
+    ring->write_pos.store(write_pos + n, std::memory_order_release);
 }
 
 void GuiAudioUpdate(void *udata)
 {
-    if (SDL_GetQueuedAudioSize(audio_device) > (2 * SAMPLES_FRAME)) {
-        fprintf(stderr, "Clear audio queue\n");
-        SDL_ClearQueuedAudio(audio_device);
-        return;
-    }
-
-    if (audio_device == 0) {
-        return;
-    }
-
-    if (SDL_QueueAudio(audio_device, audio_buffer.data(), sample_counter) < 0) {
-        fprintf(stderr, "Failed to queue audio: %s\n", SDL_GetError());
-        return;
-    }
-
-    sample_counter = 0;
-}
-
-void InitAudio()
-{
-    std::thread audio_thread(AudioThread);
-    audio_thread.detach();
+    /* the callback pulls the samples as soon as GuiAudioWrite publishes them */
 }
 
 // Main code
@@ -339,6 +383,24 @@ void GuiUpdate()
         SDL_GL_SwapWindow(window);
 }
 
+uint32_t GuiAudioQueued(void *udata)
+{
+    if (audio_device == 0)
+        return 0;
+    return audio_ring.write_pos.load(std::memory_order_relaxed) - audio_ring.read_pos.load(std::memory_order_relaxed);
+}
+
+void GuiAudioGetStats(gui_audio_stats_t *stats)
+{
+    stats->fill = GuiAudioQueued(NULL);
+    stats->capacity = RING_SAMPLES;
+    stats->underruns = audio_ring.underruns.load(std::memory_order_relaxed);
+    stats->overruns = audio_ring.overruns.load(std::memory_order_relaxed);
+    stats->min_fill = audio_ring.min_fill.exchange(UINT32_MAX, std::memory_order_relaxed);
+    if (stats->min_fill == UINT32_MAX)
+        stats->min_fill = stats->fill;
+}
+
 uint8_t GuiPollKeypad()
 {
     return key_pressed;
@@ -354,6 +416,7 @@ void GuiSetUserData(void* udata) {
 
 void GuiDestroy()
 {
+    DestroyMyWindow();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -1,6 +1,12 @@
 #include "mywindow.h"
 #include "gui.h"
 #include <imgui.h>
+#include <SDL.h>
+#if defined(IMGUI_IMPL_OPENGL_ES2)
+#include <SDL_opengles2.h>
+#else
+#include <SDL_opengl.h>
+#endif
 #include <vector>
 #include <ctime>
 #include <string>
@@ -14,24 +20,57 @@ static int tile_viewer_enabled = 0;
 
 const int tile_viewr_col = 16;
 const int tile_viewer_row = 384 / tile_viewr_col;
+/* color id 0 - 3 */
+static const uint32_t tile_viewer_palette[4] = {
+    IM_COL32(255, 255, 255, 255), IM_COL32(169, 169, 169, 255), IM_COL32(84, 84, 84, 255), IM_COL32(0, 0, 0, 255)
+};
+
+/* tile viewer texture size in pixels, tiles are separated by the border */
+const int tile_viewer_width = tile_viewr_col * (8 + tile_viewer_border_width);
+const int tile_viewer_height = tile_viewer_row * (8 + tile_viewer_border_width);
 
 static double last_frame = 0;
 static long long int last_cycles = 0;
-std::vector<ImU32> framebuffer(width * height, IM_COL32(0, 0, 0, 255)); // Initialize with black color
 
+/* the screen and the tile viewer banks are drawn as textures, one quad each */
+static GLuint screen_texture = 0;
+static GLuint tile_viewer_textures[2] = {0, 0};
+static std::vector<uint32_t> tile_viewer_pixels(tile_viewer_width * tile_viewer_height);
+
+
+GLuint CreateTexture(int w, int h) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    /* nearest-neighbour, the pixels should stay sharp when scaled up */
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    return texture;
+}
+
+/* pixels are RGBA8888 in memory order, tightly packed */
+void UploadTexture(GLuint texture, int w, int h, const void *pixels) {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+#ifdef GL_UNPACK_ROW_LENGTH
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+#endif
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
 
 // Draw the framebuffer
-void DrawFramebuffer(ImDrawList* draw_list, const std::vector<ImU32>& buffer, ImVec2 position) {
+void DrawFramebuffer(const void *buffer) {
+    if (screen_texture == 0)
+        screen_texture = CreateTexture(width, height);
 
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            ImVec2 p = ImVec2(x * pixel_size + position.x, y * pixel_size + position.y);
-            draw_list->AddRectFilled(p, ImVec2(p.x + pixel_size, p.y + pixel_size), buffer[y * width + x]);
-        }
-    }
+    UploadTexture(screen_texture, width, height, buffer);
+    ImGui::Image((ImTextureID)(intptr_t)screen_texture, ImVec2(width * pixel_size, height * pixel_size));
 }
 
-void DrawTileViewerFramebuffer(ImDrawList* draw_list, int bank, ImVec2 position) {
+void DrawTileViewerFramebuffer(int bank) {
     // Draw the tile viewer framebuffer
     gbc_t *gbc = (gbc_t*)gui_callback_udata;
     for (int row = 0; row < tile_viewer_row; row++) {
@@ -49,35 +88,22 @@ void DrawTileViewerFramebuffer(ImDrawList* draw_list, int bank, ImVec2 position)
             /* debug rom */
             // tile = (gbc_tile_t*)((gbc->mbc.rom_banks)+(0x4000 * rom_counter + 0x1800 + idx * 16));
 
-            int row_base = row * (8 + tile_viewer_border_width) * pixel_size + position.y + tile_viewer_border_width / 2 * pixel_size;
-            int col_base = col * (8 + tile_viewer_border_width) * pixel_size + position.x + tile_viewer_border_width / 2 * pixel_size;
+            /* the border is left transparent */
+            uint32_t *pixels = &tile_viewer_pixels[row * (8 + tile_viewer_border_width) * tile_viewer_width +
+                col * (8 + tile_viewer_border_width)];
             for (int y = 0; y < 8; y++) {
-                for (int x = 0; x < 8; x++) {
-                    uint8_t color_id = TILE_PIXEL_COLORID(tile, x, y);
-
-                    ImU32 color;
-                    if (color_id == 0) {
-                        color = IM_COL32(255, 255, 255, 255);
-                    } else if (color_id == 1) {
-                        color = IM_COL32(169, 169, 169, 255);
-                    } else if (color_id == 2) {
-                        color = IM_COL32(84, 84, 84, 255);
-                    } else if (color_id == 3) {
-                        color = IM_COL32(0, 0, 0, 255);
-                    } else {
-                        /* it is impossible to reach here */
-                        color = IM_COL32(255, 0, 0, 255);
-                    }
-
-                    draw_list->AddRectFilled(
-                        ImVec2(col_base + x * pixel_size, row_base + y * pixel_size),
-                        ImVec2(col_base + (x + 1) * pixel_size, row_base + (y + 1) * pixel_size),
-                        color
-                    );
-                }
+                gbc_tile_expand_row_rgba(tile->data[y * 2], tile->data[y * 2 + 1], 0, tile_viewer_palette,
+                    pixels + y * tile_viewer_width);
             }
         }
     }
+
+    if (tile_viewer_textures[bank] == 0)
+        tile_viewer_textures[bank] = CreateTexture(tile_viewer_width, tile_viewer_height);
+
+    UploadTexture(tile_viewer_textures[bank], tile_viewer_width, tile_viewer_height, tile_viewer_pixels.data());
+    ImGui::Image((ImTextureID)(intptr_t)tile_viewer_textures[bank],
+        ImVec2(tile_viewer_width * pixel_size, tile_viewer_height * pixel_size));
 }
 
 
@@ -85,8 +111,11 @@ void InitMyWindow() {
     std::srand(std::time(nullptr));
 }
 
-void GuiWrite(void *udata, unsigned short addr, unsigned short data) {
-    framebuffer[addr] = IM_COL32(GBC_COLOR_TO_RGB_R(data), GBC_COLOR_TO_RGB_G(data), GBC_COLOR_TO_RGB_B(data), 255);
+void DestroyMyWindow() {
+    if (screen_texture)
+        glDeleteTextures(1, &screen_texture);
+    glDeleteTextures(2, tile_viewer_textures);
+    screen_texture = tile_viewer_textures[0] = tile_viewer_textures[1] = 0;
 }
 
 bool IsPaused() {
@@ -99,8 +128,7 @@ void VisualizeTiles() {
     tile_viewer_row * (8 + tile_viewer_border_width) * pixel_size));
     ImGui::Begin("TileViewer Bank 0");
     ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
-    DrawTileViewerFramebuffer(draw_list, 0, ImGui::GetCursorScreenPos());
+    DrawTileViewerFramebuffer(0);
     ImGui::PopStyleVar();
     ImGui::End();
 
@@ -108,8 +136,7 @@ void VisualizeTiles() {
     tile_viewer_row * (8 + tile_viewer_border_width) * pixel_size));
     ImGui::Begin("TileViewer Bank 1");
     ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
-    draw_list = ImGui::GetWindowDrawList();
-    DrawTileViewerFramebuffer(draw_list, 1, ImGui::GetCursorScreenPos());
+    DrawTileViewerFramebuffer(1);
     ImGui::PopStyleVar();
     ImGui::End();
 }
@@ -129,6 +156,20 @@ void ClickStep() {
         gbc->debug_steps = 1;
 }
 
+bool IsTurbo() {
+    gbc_t *gbc = (gbc_t*)gui_callback_udata;
+    return gbc->pacing == GBC_PACING_TURBO;
+}
+
+void ClickTurbo() {
+    gbc_t *gbc = (gbc_t*)gui_callback_udata;
+    if (IsTurbo()) {
+        gbc_set_pacing(gbc, GBC_PACING_SLEEP, 1);
+    } else {
+        gbc_set_pacing(gbc, GBC_PACING_TURBO, 4);
+    }
+}
+
 void ShowHUDControlPanels() {
         ImGui::BeginChild("Control", ImVec2(300, 50), true);
         std::string pause_text = IsPaused() ? "Resume" : "Pause";
@@ -143,6 +184,11 @@ void ShowHUDControlPanels() {
             }
         }
 
+        ImGui::SameLine();
+        if (ImGui::Button(IsTurbo() ? "Normal" : "Turbo")) {
+            ClickTurbo();
+        }
+
         ImGui::SameLine();
         if (ImGui::Button(tile_viewer_enabled ? "Hide Tiles" : "View Tiles")) {
             tile_viewer_enabled = !tile_viewer_enabled;
@@ -190,6 +236,16 @@ void ShowHUDStatus() {
         ImGui::SameLine();
         ImGui::Text("%.2f", fps);
 
+        gui_audio_stats_t audio;
+        GuiAudioGetStats(&audio);
+        ImGui::Text("audio: ");
+        ImGui::SameLine();
+        ImGui::Text("%u/%u (min %u)", audio.fill, audio.capacity, audio.min_fill);
+
+        ImGui::Text("underruns: ");
+        ImGui::SameLine();
+        ImGui::Text("%u, overruns: %u", audio.underruns, audio.overruns);
+
         ImGui::Separator(); // Optional separator line
 
         if (ImGui::BeginTable("REG", 4))
@@ -226,8 +282,9 @@ void ShowGame() {
     ImGui::SetNextWindowSize(ImVec2(width * pixel_size, height * pixel_size + 30));
     ImGui::PushStyleVar(ImGuiStyleVar_WindowPadding, ImVec2(0, 0));
     ImGui::Begin("GBC");
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
-    DrawFramebuffer(draw_list, framebuffer, ImGui::GetCursorScreenPos());
+    gbc_t *gbc = (gbc_t*)gui_callback_udata;
+    /* RGBA8888, see main.c */
+    DrawFramebuffer(gbc_graphic_frame(&gbc->graphic));
     ImGui::End();
     ImGui::PopStyleVar();
 }
@@ -1,4 +1,7 @@
 #pragma once 
 
 void ShowMyWindow();
-void InitMyWindow();
\ No newline at end of file
+void InitMyWindow();
+
+/* releases the textures, the GL context must still be current */
+void DestroyMyWindow();
\ No newline at end of file
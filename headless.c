@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <string.h>
+#include "gbc.h"
+#include "rewind.h"
+#include "common.h"
+
+/* runs a cartridge without any window or audio device, as fast as the host can */
+
+#define USEAGE "Usage: kgbc-headless -r cartridge [-b boot_rom] [-f frames | -c cycles] [-o output_dir] [-s] [-a] [-w] [-p]\n" \
+                "  cartridge: path to the gameboy cartridge file\n" \
+                "  boot_rom(optional): path to the boot rom\n" \
+                "  frames: logic frames to run, default 600\n" \
+                "  cycles: base clock cycles (4MHz) to run instead of frames, rounded up to whole frames\n" \
+                "  output_dir: where the dumps are written, default the current directory\n" \
+                "  -s: dump the last frame to output_dir/screen.ppm\n" \
+                "  -a: dump the audio to output_dir/audio.wav\n" \
+                "  -w: keep a rewind history while running, like the GUI does\n" \
+                "  -p: keep the battery backed RAM in the .sav next to the cartridge, like the GUI does\n"
+
+typedef struct headless_args headless_args_t;
+
+struct headless_args {
+    char *cartridge;
+    char *boot_rom;
+    char *output_dir;
+    uint64_t frames;
+    uint64_t cycles;
+    uint8_t dump_screen:1;
+    uint8_t dump_audio:1;
+    uint8_t rewind:1;
+    uint8_t persist:1;
+};
+
+static int16_t *audio_samples;
+static size_t audio_samples_count;
+static size_t audio_samples_capacity;
+static uint8_t recording_audio;
+
+static void
+usage()
+{
+    printf(USEAGE);
+    exit(1);
+}
+
+static char*
+next_arg(int argc, char **argv, int *i)
+{
+    if (++*i >= argc)
+        usage();
+    return argv[*i];
+}
+
+static void
+parse_args(int argc, char **argv, headless_args_t *args)
+{
+    memset(args, 0, sizeof(headless_args_t));
+    args->output_dir = ".";
+    args->frames = 600;
+
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (arg[0] != '-') {
+            continue;
+        }
+
+        switch (arg[1]) {
+        case 'r':
+            args->cartridge = next_arg(argc, argv, &i);
+            break;
+        case 'b':
+            args->boot_rom = next_arg(argc, argv, &i);
+            break;
+        case 'f':
+            args->frames = strtoull(next_arg(argc, argv, &i), NULL, 0);
+            break;
+        case 'c':
+            args->cycles = strtoull(next_arg(argc, argv, &i), NULL, 0);
+            break;
+        case 'o':
+            args->output_dir = next_arg(argc, argv, &i);
+            break;
+        case 's':
+            args->dump_screen = 1;
+            break;
+        case 'a':
+            args->dump_audio = 1;
+            break;
+        case 'w':
+            args->rewind = 1;
+            break;
+        case 'p':
+            args->persist = 1;
+            break;
+        default:
+            usage();
+            break;
+        }
+    }
+
+    if (args->cartridge == NULL)
+        usage();
+}
+
+static void
+headless_screen_update(void *udata)
+{
+}
+
+static void
+headless_audio_write(const int16_t *frames, size_t n)
+{
+    if (!recording_audio)
+        return;
+
+    while (audio_samples_count + n * 2 > audio_samples_capacity) {
+        audio_samples_capacity = audio_samples_capacity ? audio_samples_capacity * 2 : GBC_AUDIO_SAMPLE_RATE * 2;
+        audio_samples = (int16_t*)realloc(audio_samples, audio_samples_capacity * sizeof(int16_t));
+        if (!audio_samples) {
+            LOG_ERROR("[HEADLESS] Failed to allocate audio buffer\n");
+            abort();
+        }
+    }
+
+    memcpy(audio_samples + audio_samples_count, frames, n * 2 * sizeof(int16_t));
+    audio_samples_count += n * 2;
+}
+
+static void
+headless_audio_update(void *udata)
+{
+}
+
+static uint8_t
+headless_poll_keypad()
+{
+    /* nobody is pressing anything */
+    return 0;
+}
+
+static FILE*
+open_output(const char *dir, const char *name)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        LOG_ERROR("[HEADLESS] Failed to open %s\n", path);
+    return f;
+}
+
+static void
+write_le(FILE *f, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        fputc((value >> (i * 8)) & 0xff, f);
+}
+
+static int
+dump_screen(gbc_graphic_t *graphic, const char *dir)
+{
+    const uint16_t *framebuffer = (const uint16_t*)gbc_graphic_frame(graphic);
+    FILE *f = open_output(dir, "screen.ppm");
+    if (!f)
+        return 1;
+
+    fprintf(f, "P6\n%d %d\n255\n", VISIBLE_HORIZONTAL_PIXELS, VISIBLE_VERTICAL_PIXELS);
+    for (int i = 0; i < FRAMEBUFFER_PIXELS; i++) {
+        uint16_t color = framebuffer[i];
+        fputc(GBC_COLOR_TO_RGB_R(color), f);
+        fputc(GBC_COLOR_TO_RGB_G(color), f);
+        fputc(GBC_COLOR_TO_RGB_B(color), f);
+    }
+
+    fclose(f);
+    return 0;
+}
+
+/* 16 bit stereo PCM */
+static int
+dump_audio(const char *dir)
+{
+    FILE *f = open_output(dir, "audio.wav");
+    if (!f)
+        return 1;
+
+    uint32_t data_size = (uint32_t)(audio_samples_count * 2);
+
+    fwrite("RIFF", 1, 4, f);
+    write_le(f, 36 + data_size, 4);
+    fwrite("WAVEfmt ", 1, 8, f);
+    write_le(f, 16, 4);                         /* fmt chunk size */
+    write_le(f, 1, 2);                          /* PCM */
+    write_le(f, 2, 2);                          /* channels */
+    write_le(f, GBC_AUDIO_SAMPLE_RATE, 4);
+    write_le(f, GBC_AUDIO_SAMPLE_RATE * 4, 4);  /* bytes per second */
+    write_le(f, 4, 2);                          /* block align */
+    write_le(f, 16, 2);                         /* bits per sample */
+    fwrite("data", 1, 4, f);
+    write_le(f, data_size, 4);
+
+    for (size_t i = 0; i < audio_samples_count; i++)
+        write_le(f, (uint16_t)audio_samples[i], 2);
+
+    fclose(f);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    headless_args_t args;
+    parse_args(argc, argv, &args);
+
+    static gbc_t gbc;
+    if (gbc_init(&gbc, args.cartridge, args.boot_rom) != 0)
+        return 1;
+    /* off by default, the runs would depend on the previous ones */
+    if (args.persist && gbc_attach_sav(&gbc, args.cartridge) != 0)
+        return 1;
+
+    gbc.io.poll_keypad = headless_poll_keypad;
+    gbc_graphic_set_format(&gbc.graphic, GBC_PIXEL_RGB555, 1);
+    gbc.graphic.screen_update = headless_screen_update;
+    gbc.audio.audio_write = headless_audio_write;
+    gbc.audio.audio_update = headless_audio_update;
+    recording_audio = args.dump_audio;
+
+    if (args.rewind) {
+        gbc.rewind = gbc_rewind_create(&gbc, GBC_REWIND_DEFAULT_SIZE, 1);
+        if (!gbc.rewind)
+            return 1;
+    }
+
+    uint64_t start = get_time();
+    uint64_t frames = 0;
+
+    /* no FRAME_INTERVAL pacing here, frames run back to back */
+    if (args.cycles) {
+        while (gbc.sched.clocks < args.cycles) {
+            gbc_frame(&gbc);
+            frames++;
+        }
+    } else {
+        while (frames < args.frames) {
+            gbc_frame(&gbc);
+            frames++;
+        }
+    }
+
+    uint64_t elapsed = get_time() - start;
+    LOG_INFO("Ran %llu frames (%llu clocks) in %.3f s, %.1f fps\n",
+        (unsigned long long)frames, (unsigned long long)gbc.sched.clocks,
+        elapsed / 1e9, elapsed ? frames * 1e9 / elapsed : 0.0);
+    if (gbc.rewind) {
+        LOG_INFO("Rewind history %llu frames in %zu bytes\n",
+            (unsigned long long)gbc_rewind_frames(gbc.rewind), gbc_rewind_used(gbc.rewind));
+    }
+
+    int ret = 0;
+    if (args.dump_screen)
+        ret |= dump_screen(&gbc.graphic, args.output_dir);
+    if (args.dump_audio)
+        ret |= dump_audio(args.output_dir);
+
+    gbc_rewind_destroy(gbc.rewind);
+    gbc_destroy(&gbc);
+    free(audio_samples);
+    return ret;
+}
@@ -7,7 +7,8 @@ stop(gbc_cpu_t *cpu, instruction_t *ins)
 {
     LOG_DEBUG("STOP: %s\n", ins->name);
     gbc_memory_t *mem = (gbc_memory_t*)cpu->mem_data;
-    uint8_t key1 = IO_PORT_READ(mem, IO_PORT_KEY1);
+    /* read it through the bus, the other components have to catch up before the speed changes */
+    uint8_t key1 = cpu->mem_read(cpu->mem_data, IO_PORT_ADDR(IO_PORT_KEY1));
     if (key1 & KEY1_CPU_SWITCH_ARMED) {
         cpu->dspeed = !cpu->dspeed;
         if (cpu->dspeed)
@@ -1837,10 +1838,10 @@ cb_set_m16(gbc_cpu_t *cpu, instruction_t *ins)
     cpu->mem_write(cpu->mem_data, addr, result);
 }
 
-/* The following fields in instruction will be modified during the execution:
-    r_cycles, op1, op2, opcode_ext
+/* The tables are read-only so any number of cpus can share them,
+   decode copies an entry out and fills in r_cycles and opcode_ext
  */
-static instruction_t instruction_set[INSTRUCTIONS_SET_SIZE] = {
+static const instruction_t instruction_set[INSTRUCTIONS_SET_SIZE] = {
     /* 0x00 */
     INSTRUCTION_ADD(0x00, 1, nop, NULL, NULL, 4, 4, "NOP"),
     INSTRUCTION_ADD(0x01, 3, ld_r16_i16, REG_BC, NULL, 12, 12, "LD BC, n16"),
@@ -2130,7 +2131,7 @@ static instruction_t instruction_set[INSTRUCTIONS_SET_SIZE] = {
     INSTRUCTION_ADD(0xff, 1, rst, 0x38, NULL, 16, 16, "RST 38H"),
 };
 
-static instruction_t prefixed_instruction_set[INSTRUCTIONS_SET_SIZE] = {
+static const instruction_t prefixed_instruction_set[INSTRUCTIONS_SET_SIZE] = {
     /* 0x00 */
     INSTRUCTION_ADD(0x00, 2, cb_rlc_r8, REG_B, NULL, 8, 8, "RLC B"),
     INSTRUCTION_ADD(0x01, 2, cb_rlc_r8, REG_C, NULL, 8, 8, "RLC C"),
@@ -2420,39 +2421,29 @@ static instruction_t prefixed_instruction_set[INSTRUCTIONS_SET_SIZE] = {
     INSTRUCTION_ADD(0xff, 2, cb_set_r8, 7, REG_A, 8, 8, "SET 7, A"),
 };
 
+/* The tables are indexed by opcode, make sure nobody breaks the order */
 void
 init_instruction_set()
 {
-    int idx;
-    instruction_t t;
     for (int i = 0; i < INSTRUCTIONS_SET_SIZE; i++) {
-
-        if (instruction_set[i].func) {
-            idx = instruction_set[i].opcode;
-            if (idx != i) {
-                t = instruction_set[idx];
-                instruction_set[idx] = instruction_set[i];
-                instruction_set[i] = t;
-            }
+        if (instruction_set[i].func && instruction_set[i].opcode != i) {
+            LOG_ERROR("Instruction [0x%x] is at the wrong place [0x%x]\n", instruction_set[i].opcode, i);
+            abort();
         }
 
-        if (prefixed_instruction_set[i].func) {
-            idx = prefixed_instruction_set[i].opcode;
-            if (idx != i) {
-                t = instruction_set[idx];
-                prefixed_instruction_set[idx] = prefixed_instruction_set[i];
-                instruction_set[i] = t;
-            }
+        if (prefixed_instruction_set[i].func && prefixed_instruction_set[i].opcode != i) {
+            LOG_ERROR("Instruction [0xcb 0x%x] is at the wrong place [0x%x]\n", prefixed_instruction_set[i].opcode, i);
+            abort();
         }
     }
 }
 
 instruction_t*
-decode(uint8_t *data)
+decode(uint8_t *data, instruction_t *inst)
 {
     uint8_t opcode = data[0];
     int size = 0;
-    instruction_t *inst_set = instruction_set;
+    const instruction_t *inst_set = instruction_set;
 
     if (opcode == PREFIX_CB) {
         inst_set = prefixed_instruction_set;
@@ -2460,7 +2451,7 @@ decode(uint8_t *data)
         opcode = READ_I8(data[1]);
     }
 
-    instruction_t *inst = inst_set + opcode;
+    *inst = inst_set[opcode];
 
     inst->r_cycles = inst->cycles;
     size += inst->size;
@@ -2481,11 +2472,11 @@ decode(uint8_t *data)
 }
 
 instruction_t*
-decode_mem(memory_read read, uint16_t addr, void *udata)
+decode_mem(memory_read read, uint16_t addr, void *udata, instruction_t *inst)
 {
     uint8_t opcode = read(udata, addr);
     int size = 0;
-    instruction_t *inst_set = instruction_set;
+    const instruction_t *inst_set = instruction_set;
 
     if (opcode == PREFIX_CB) {
         inst_set = prefixed_instruction_set;
@@ -2493,7 +2484,7 @@ decode_mem(memory_read read, uint16_t addr, void *udata)
         opcode = READ_I8(read(udata, addr + 1));
     }
 
-    instruction_t *inst = inst_set + opcode;
+    *inst = inst_set[opcode];
 
     inst->r_cycles = inst->cycles;
     size += inst->size;
@@ -1,7 +1,7 @@
 #ifndef _INSTRUCTION_SET_H
 #define _INSTRUCTION_SET_H
 
-#include "gbc.h"
+#include "cpu.h"
 
 typedef struct instruction instruction_t;
 typedef void (*instruction_func)(gbc_cpu_t *cpu, instruction_t *ins);
@@ -31,8 +31,9 @@ struct instruction
 };
 
 void init_instruction_set();
-instruction_t* decode(uint8_t *data);
-instruction_t* decode_mem(memory_read read, uint16_t addr, void *udata);
+/* decodes into the caller's inst, usually on the stack */
+instruction_t* decode(uint8_t *data, instruction_t *inst);
+instruction_t* decode_mem(memory_read read, uint16_t addr, void *udata, instruction_t *inst);
 void test_instructions();
 void int_call_i16(gbc_cpu_t *cpu, uint16_t addr);
 
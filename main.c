@@ -9,6 +9,7 @@
 #include "instruction_set.h"
 #include "gui.h"
 #include "rom_dialog.h"
+#include "rewind.h"
 
 #define USEAGE "Usage: xgbc -r cartridge [-b boot_rom]\n" \
                 "  cartridge: path to the gameboy cartridge file\n" \
@@ -76,16 +77,24 @@ main(int argc, char **argv)
     while (RomDialog(&cartridge, &boot_rom))
         ;
 
-    gbc_t gbc;
-    if (gbc_init(&gbc, cartridge, boot_rom) == 0) {
+    gbc_t *gbc = gbc_create(cartridge, boot_rom, NULL, 0);
+    if (gbc) {
+        gbc_attach_sav(gbc, cartridge);
         GuiSetCloseCallback(close_callback);
-        GuiSetUserData(&gbc);
-        gbc.io.poll_keypad = GuiPollKeypad;
-        gbc.graphic.screen_write = GuiWrite;
-        gbc.graphic.screen_update = GuiUpdate;
-        gbc.audio.audio_write = GuiAudioWrite;
-        gbc.audio.audio_update = GuiAudioUpdate;
-        gbc_run(&gbc);
+        GuiSetUserData(gbc);
+        gbc->io.poll_keypad = GuiPollKeypad;
+        gbc_graphic_set_format(&gbc->graphic, GBC_PIXEL_RGBA8888, 1);
+        gbc->graphic.screen_update = GuiUpdate;
+        gbc->audio.audio_write = GuiAudioWrite;
+        gbc->audio.audio_update = GuiAudioUpdate;
+        gbc->audio.audio_queued = GuiAudioQueued;
+        /* the frames keep the display timing, the audio follows them */
+        gbc->audio.drc_target = GBC_AUDIO_DRC_TARGET;
+        gbc_set_pacing(gbc, GBC_PACING_SLEEP, 1);
+        gbc->rewind = gbc_rewind_create(gbc, GBC_REWIND_DEFAULT_SIZE, 1);
+        gbc_run(gbc);
+        gbc_rewind_destroy(gbc->rewind);
+        gbc_destroy(gbc);
     }
 
     LOG_INFO("Emulator terminated\n");
@@ -1,3 +1,4 @@
+#include <time.h>
 #include "mbc.h"
 
 
@@ -10,36 +11,161 @@ uint8_t mbc3_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data);
 uint8_t mbc5_read(gbc_mbc_t *mbc, uint16_t addr);
 uint8_t mbc5_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data);
 
+uint8_t mbc2_read(gbc_mbc_t *mbc, uint16_t addr);
+uint8_t mbc2_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data);
+
+uint8_t rom_only_read(gbc_mbc_t *mbc, uint16_t addr);
+uint8_t rom_only_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data);
+
+uint8_t huc1_read(gbc_mbc_t *mbc, uint16_t addr);
+uint8_t huc1_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data);
+
+static void mbc1_map(gbc_mbc_t *mbc);
+static void mbc2_map(gbc_mbc_t *mbc);
+static void mbc3_map(gbc_mbc_t *mbc);
+static void mbc5_map(gbc_mbc_t *mbc);
+static void rom_only_map(gbc_mbc_t *mbc);
+static void huc1_map(gbc_mbc_t *mbc);
+
+static void
+mbc_remap(void *udata)
+{
+    gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
+    gbc_memory_t *mem = mbc->mem;
+
+    if (mbc->rom_banks == NULL) {
+        map_memory_pages(mem, ROM_BANK_0_BEGIN, ROM_BANK_N_END, NULL, NULL);
+        map_memory_pages(mem, EXRAM_BEGIN, EXRAM_END, NULL, NULL);
+        return;
+    }
+
+    map_memory_pages(mem, ROM_BANK_0_BEGIN, ROM_BANK_0_END, mbc->rom_banks, NULL);
+    if (mem->boot_rom_enabled) {
+        /*
+          https://gbdev.io/pandocs/Power_Up_Sequence.html#size
+          the boot rom is overlaid except 0x100 - 0x1ff (the cartridge header),
+          the 0xff50 write remaps it away
+        */
+        map_memory_pages(mem, 0x0000, 0x00ff, mem->boot_rom, NULL);
+        map_memory_pages(mem, 0x0200, GBC_BOOT_ROM_SIZE - 1, mem->boot_rom + 0x200, NULL);
+    }
+
+    mbc->map(mbc);
+}
+
+/* the external RAM is the mapped .sav, a clock-only .sav leaves it malloc'ed */
+static inline uint8_t
+mbc_ram_in_sav(gbc_mbc_t *mbc)
+{
+    return mbc->sav.data && mbc->ram_banks == mbc->sav.data;
+}
+
+/*
+  Every MBC's map function ends up here when its bank registers change, the
+  selected banks are resolved once into host pointers and direct pages.
+  The ROM bank number wraps at the ROM size like the real chips that ignore
+  the upper bits, invalid RAM banks are left to the handlers to report.
+*/
+static void
+mbc_map_banks(gbc_mbc_t *mbc, uint16_t rom_bank, uint8_t ram_bank)
+{
+    gbc_memory_t *mem = mbc->mem;
+    uint8_t *rom, *ram = NULL;
+
+    rom = mbc->rom_banks + (rom_bank & (mbc->rom_bank_size - 1)) * ROM_BANK_SIZE;
+
+    if (ram_bank < mbc->ram_bank_size)
+        ram = mbc->ram_banks + ram_bank * RAM_BANK_SIZE;
+
+    mbc->rom_bank_n_ptr = rom;
+    mbc->ram_bank_ptr = ram;
+
+    map_memory_pages(mem, ROM_BANK_N_BEGIN, ROM_BANK_N_END, rom, NULL);
+    /* writes are ignored when the external RAM is disabled, reads are not */
+    map_memory_pages(mem, EXRAM_BEGIN, EXRAM_END, ram, mbc->ram_enabled ? ram : NULL);
+
+    if (!ram || !mbc->ram_enabled || !mbc_ram_in_sav(mbc))
+        return;
+
+    /* clean pages of a .sav stay write protected, the first write marks them dirty */
+    uint32_t first_page = (ram - mbc->ram_banks) >> MEMORY_PAGE_SHIFT;
+    for (int i = 0; i < (RAM_BANK_SIZE >> MEMORY_PAGE_SHIFT); i++) {
+        if (!mbc->ram_dirty[first_page + i]) {
+            uint16_t begin = EXRAM_BEGIN + (i << MEMORY_PAGE_SHIFT);
+            map_memory_pages(mem, begin, begin | MEMORY_PAGE_MASK, ram + (i << MEMORY_PAGE_SHIFT), NULL);
+        }
+    }
+}
+
+/* every write to the external RAM that does not go through a direct page ends up here */
+static void
+mbc_ram_write(gbc_mbc_t *mbc, uint32_t offset, uint8_t data)
+{
+    mbc->ram_banks[offset] = data;
+
+    if (mbc_ram_in_sav(mbc) && !mbc->ram_dirty[offset >> MEMORY_PAGE_SHIFT]) {
+        gbc_mbc_mark_ram(mbc, offset);
+        /* the page can be written directly until the next flush */
+        mbc->map(mbc);
+    }
+}
+
+/* only what the direct pages can not serve ends up in the handlers */
 uint8_t
 mbc_read(void *udata, uint16_t addr)
 {
     gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
-    /* https://gbdev.io/pandocs/Power_Up_Sequence.html#size */
-    if (mbc->mem->boot_rom_enabled && !IN_RANGE(addr, 0x100, 0x1ff)) {
-        return mbc->mem->boot_rom[addr];
-    }
+
+    if (addr <= ROM_BANK_0_END)
+        return mbc->rom_banks[addr];
+    if (addr <= ROM_BANK_N_END)
+        return mbc->rom_bank_n_ptr[addr & ROM_ADDR_MASK];
+    if (mbc->ram_bank_ptr)
+        return mbc->ram_bank_ptr[addr & RAM_ADDR_MASK];
+    /* the clock registers, the banks the cartridge does not have */
     return mbc->read(mbc, addr);
 }
 
 uint8_t mbc_write(void *udata, uint16_t addr, uint8_t data)
 {
     gbc_mbc_t *mbc = (gbc_mbc_t*)udata;
-    return mbc->write(mbc, addr, data);
+
+    if (addr >= EXRAM_BEGIN && mbc->ram_bank_ptr && mbc->ram_enabled) {
+        /* a write protected page of the .sav */
+        mbc_ram_write(mbc, (mbc->ram_bank_ptr - mbc->ram_banks) + (addr & RAM_ADDR_MASK), data);
+        return data;
+    }
+
+    data = mbc->write(mbc, addr, data);
+    if (addr <= ROM_BANK_N_END) {
+        /* MBC registers, the banks may have been switched */
+        mbc->map(mbc);
+    }
+    return data;
 }
 
 void
 gbc_mbc_init(gbc_mbc_t *mbc)
 {
     mbc->rom_banks = NULL;
+    mbc->rom_bank_n_ptr = NULL;
+    mbc->ram_bank_ptr = NULL;
     mbc->rom_bank = 0;
     mbc->ram_bank = 0;
     mbc->ram_enabled = 0;
     mbc->mode = 0;
     mbc->mem = NULL;
+    mbc->sav_path = NULL;
+    mbc->flush_interval = MBC_FLUSH_INTERVAL;
+    mbc->flush_frames = 0;
+    mbc->has_rtc = 0;
+    mbc->clocks = NULL;
+    memset(&mbc->rtc, 0, sizeof(gbc_rtc_t));
 
     /* Default to MBC1 */
     mbc->read = mbc1_read;
     mbc->write = mbc1_write;
+    mbc->map = mbc1_map;
 }
 
 void
@@ -53,6 +179,7 @@ gbc_mbc_connect(gbc_mbc_t *mbc, gbc_memory_t *mem)
     entry.addr_end = ROM_BANK_0_END;
     entry.read = mbc_read;
     entry.write = mbc_write;
+    entry.remap = mbc_remap;
     entry.udata = mbc;
 
     register_memory_map(mem, &entry);
@@ -62,6 +189,7 @@ gbc_mbc_connect(gbc_mbc_t *mbc, gbc_memory_t *mem)
     entry.addr_end = ROM_BANK_N_END;
     entry.read = mbc_read;
     entry.write = mbc_write;
+    entry.remap = mbc_remap;
     entry.udata = mbc;
 
     register_memory_map(mem, &entry);
@@ -71,37 +199,69 @@ gbc_mbc_connect(gbc_mbc_t *mbc, gbc_memory_t *mem)
     entry.addr_end = EXRAM_END;
     entry.read = mbc_read;
     entry.write = mbc_write;
+    entry.remap = mbc_remap;
     entry.udata = mbc;
 
     register_memory_map(mem, &entry);
 }
 
-void
-gbc_mbc_init_with_cart(gbc_mbc_t *mbc, cartridge_t *cart)
+/* external RAM banks of the cartridge */
+static uint8_t
+mbc_ram_banks(cartridge_t *cart)
 {
-    mbc->rom_bank_size = cartridge_rom_banks(cart);
-
-    uint8_t ram_size = 0;
     switch (cart->ram_size) {
         /* 0 should mean no RAM, but the blargg's test roms 'interrupt_time.gb' accesses 0xa0001 with a
             0 external ram size in caridge header. I dont know if it is a bug in the test rom.
         */
-        case 0: ram_size = 1; break;
-        case 2: ram_size = 1; break;
-        case 3: ram_size = 4; break;
-        case 4: ram_size = 16; break;
-        case 5: ram_size = 8; break;
+        case 0: return 1;
+        case 1: return 1;   /* 2KB, it gets a whole bank */
+        case 2: return 1;
+        case 3: return 4;
+        case 4: return 16;
+        case 5: return 8;
         default:
             LOG_ERROR("[MBC] Invalid RAM size %d\n", cart->ram_size);
             abort();
     }
-    mbc->ram_bank_size = ram_size;
+}
+
+size_t
+gbc_mbc_ram_size(cartridge_t *cart)
+{
+    /* the header says none, it is in the MBC */
+    if (cart->cartridge_type == CART_TYPE_MBC2 || cart->cartridge_type == CART_TYPE_MBC2_BATTERY)
+        return MBC2_RAM_SIZE;
+    return (size_t)mbc_ram_banks(cart) * RAM_BANK_SIZE;
+}
+
+void
+gbc_mbc_init_with_cart(gbc_mbc_t *mbc, cartridge_t *cart, uint8_t *ram)
+{
+    mbc->rom_bank_size = cartridge_rom_banks(cart);
+    mbc->ram_bank_size = mbc_ram_banks(cart);
+    mbc->ram_size = gbc_mbc_ram_size(cart);
+
+    /* only what the cartridge has, a .sav replaces it in gbc_mbc_attach_sav */
+    mbc->ram_owned = ram == NULL;
+    mbc->ram_banks = ram ? ram : (uint8_t*)malloc_memory(mbc->ram_size);
+    if (!mbc->ram_banks) {
+        LOG_ERROR("[MBC] Failed to allocate memory\n");
+        abort();
+    }
+    memset(mbc->ram_banks, 0, mbc->ram_size);
+
     mbc->rom_bank = 0;
     mbc->ram_bank = 0;
     mbc->ram_enabled = 0;
     mbc->mode = 0;
     mbc->type = cart->cartridge_type;
     mbc->cart = cart;
+    mbc->has_rtc = cartridge_has_rtc(cart);
+    mbc->has_rumble = 0;
+    mbc->rumbling = 0;
+    memset(&mbc->rtc, 0, sizeof(gbc_rtc_t));
+    if (mbc->clocks)
+        mbc->rtc.clocks = *mbc->clocks;
 
     /* I havent found any information about how to map the cartidge file to Rom Bank in PanDoc, possibly because
         real  doesn't use a cartidge file.
@@ -110,34 +270,76 @@ gbc_mbc_init_with_cart(gbc_mbc_t *mbc, cartridge_t *cart)
 
     switch (mbc->type)
     {
+        case CART_TYPE_ROM_ONLY:
+        case CART_TYPE_ROM_RAM:
+        case CART_TYPE_ROM_RAM_BATTERY:
+
+            mbc->read = rom_only_read;
+            mbc->write = rom_only_write;
+            mbc->map = rom_only_map;
+            /* there is nothing to enable it */
+            mbc->ram_enabled = 1;
+            break;
+
         case CART_TYPE_MBC1:
         case CART_TYPE_MBC1_RAM:
         case CART_TYPE_MBC1_RAM_BATTERY:
 
             mbc->read = mbc1_read;
             mbc->write = mbc1_write;
+            mbc->map = mbc1_map;
             break;
 
+        case CART_TYPE_MBC3_TIMER_BATTERY:
+        case CART_TYPE_MBC3_TIMER_RAM_BATTERY:
         case CART_TYPE_MBC3:
         case CART_TYPE_MBC3_RAM:
         case CART_TYPE_MBC3_RAM_BATTERY:
 
             mbc->read = mbc3_read;
             mbc->write = mbc3_write;
+            mbc->map = mbc3_map;
+            break;
+
+        case CART_TYPE_MBC2:
+        case CART_TYPE_MBC2_BATTERY:
+
+            mbc->read = mbc2_read;
+            mbc->write = mbc2_write;
+            mbc->map = mbc2_map;
+            memset(mbc->ram_banks, MBC2_RAM_UNUSED_BITS, mbc->ram_size);
             break;
 
+        case CART_TYPE_MBC5_RUMBLE:
+        case CART_TYPE_MBC5_RUMBLE_RAM:
+        case CART_TYPE_MBC5_RUMBLE_RAM_BATTERY:
+
+            mbc->has_rumble = 1;
+            /* fall through */
         case CART_TYPE_MBC5:
         case CART_TYPE_MBC5_RAM:
         case CART_TYPE_MBC5_RAM_BATTERY:
 
             mbc->read = mbc5_read;
             mbc->write = mbc5_write;
+            mbc->map = mbc5_map;
+            break;
+
+        case CART_TYPE_HUC1_RAM_BATTERY:
+
+            mbc->read = huc1_read;
+            mbc->write = huc1_write;
+            mbc->map = huc1_map;
+            /* only the infrared mode takes it away */
+            mbc->ram_enabled = 1;
             break;
 
         default:
             LOG_ERROR("[MBC] Unsupported MBC type %d\n", mbc->type);
             abort();
     }
+
+    mbc_remap(mbc);
 }
 
 /*
@@ -188,47 +390,343 @@ translate_mbc5_addr(gbc_mbc_t *mbc, uint16_t raw_addr)
     return addr;
 }
 
-uint8_t
-mbc1_read(gbc_mbc_t *mbc, uint16_t addr)
+static void
+mbc1_map(gbc_mbc_t *mbc)
 {
-    LOG_DEBUG("[MBC1] Reading from MBC1 at address %x\n", addr);
+    uint32_t rom_addr = translate_mbc1_addr(mbc, MBC1_ROM_BANK_N_BEGIN);
+    uint32_t ram_addr = translate_mbc1_addr(mbc, MBC1_RAM_BEGIN);
+    uint16_t rom_bank = (rom_addr >> ROM_ADDR_MASK_SHIFT) & MBC1_ROM_BANK_MASK;
+    uint8_t ram_bank = (ram_addr >> RAM_ADDR_MASK_SHIFT) & MBC1_RAM_BANK_MASK;
 
-    if (IN_RANGE(addr, MBC1_ROM_BANK0_BEGIN, MBC1_ROM_BANK0_END)) {
-        return mbc->rom_banks[addr];
+    if (rom_bank == 0) rom_bank = 1; /* If the bank number is 0, it is treated as bank 1 */
+    mbc_map_banks(mbc, rom_bank, ram_bank);
+}
 
-    } else if (IN_RANGE(addr, MBC1_ROM_BANK_N_BEGIN, MBC1_ROM_BANK_N_END)) {
-        uint32_t mbc1_rom_addr = translate_mbc1_addr(mbc, addr);
-        uint16_t raddr = mbc1_rom_addr & ROM_ADDR_MASK;
-        uint16_t bank = (mbc1_rom_addr >> ROM_ADDR_MASK_SHIFT) & MBC1_ROM_BANK_MASK;
-        if (bank == 0) bank = 1; /* If the bank number is 0, it is treated as bank 1 */
-        LOG_DEBUG("[MBC1] Reading from MBC1 ROM Bank [%x] at address %x\n", bank, raddr);
-
-        if (bank >= mbc->rom_bank_size) {
-            LOG_ERROR("[MBC1] Invalid read: addr: %x. Trying to read from invalid ROM bank: %d, bank_size: %d\n",
-                        addr, bank, mbc->rom_bank_size);
-            // this crashes some blargg's test roms, dont know why
-            //abort();
-        }
+static void
+mbc5_map(gbc_mbc_t *mbc)
+{
+    uint32_t rom_addr = translate_mbc5_addr(mbc, MBC1_ROM_BANK_N_BEGIN);
+    uint32_t ram_addr = translate_mbc5_addr(mbc, MBC1_RAM_BEGIN);
+    uint16_t rom_bank = (rom_addr >> ROM_ADDR_MASK_SHIFT) & MBC5_ROM_BANK_MASK;
+    uint8_t ram_bank = (ram_addr >> RAM_ADDR_MASK_SHIFT) & MBC5_RAM_BANK_MASK;
 
-        return mbc->rom_banks[bank * ROM_BANK_SIZE + raddr];
+    mbc_map_banks(mbc, rom_bank, ram_bank);
+}
 
-    } else if (IN_RANGE(addr, MBC1_RAM_BEGIN, MBC1_RAM_END)) {
-        uint32_t mbc1_ram_addr = translate_mbc1_addr(mbc, addr);
-        uint16_t raddr = mbc1_ram_addr & RAM_ADDR_MASK;
-        uint8_t bank = (mbc1_ram_addr >> RAM_ADDR_MASK_SHIFT) & MBC1_RAM_BANK_MASK;
+static void
+rom_only_map(gbc_mbc_t *mbc)
+{
+    /* 32KB, 0x4000 - 0x7fff is always the second bank */
+    mbc_map_banks(mbc, 1, 0);
+}
 
-        LOG_DEBUG("[MBC1] Reading from MBC1 RAM Bank [%x] at address %x\n", bank, raddr);
+static void
+mbc2_map(gbc_mbc_t *mbc)
+{
+    uint16_t rom_bank = mbc->rom_bank & MBC2_ROM_BANK_MASK;
+    if (rom_bank == 0) rom_bank = 1;
 
-        if (bank >= mbc->ram_bank_size) {
-            LOG_ERROR("[MBC1] Invalid read: addr: %x. Trying to read from invalid RAM bank: %d, bank_size: %d\n",
-                        addr, bank, mbc->ram_bank_size);
-            abort();
-        }
+    /* the RAM is not a bank, it is mapped below */
+    mbc_map_banks(mbc, rom_bank, 0xff);
+
+    /* the 512 half bytes repeat over the whole area, writes go through mbc2_write to keep the unused bits set */
+    for (uint32_t addr = EXRAM_BEGIN; addr <= EXRAM_END; addr += MBC2_RAM_SIZE)
+        map_memory_pages(mbc->mem, addr, addr + MBC2_RAM_MASK, mbc->ram_banks, NULL);
+}
+
+static void
+huc1_map(gbc_mbc_t *mbc)
+{
+    uint16_t rom_bank = mbc->rom_bank & HUC1_ROM_BANK_MASK;
+    if (rom_bank == 0) rom_bank = 1;
+
+    /* the infrared port goes through the handlers */
+    mbc_map_banks(mbc, rom_bank, mbc->mode ? 0xff : mbc->ram_bank & HUC1_RAM_BANK_MASK);
+}
+
+/*
+  https://gbdev.io/pandocs/MBC3.html#the-clock-counter-registers
+  The counters are only brought up to date when the game touches them or the
+  .sav is flushed.
+*/
+static uint16_t
+rtc_days(gbc_rtc_t *rtc)
+{
+    return rtc->regs[MBC3_RTC_DL - MBC3_RTC_S] | ((rtc->regs[MBC3_RTC_DH - MBC3_RTC_S] & MBC3_RTC_DH_DAY_MSB) << 8);
+}
+
+static void
+rtc_set_days(gbc_rtc_t *rtc, uint32_t days)
+{
+    uint8_t *dh = &rtc->regs[MBC3_RTC_DH - MBC3_RTC_S];
+
+    if (days > 0x1ff)
+        *dh |= MBC3_RTC_DH_CARRY;     /* sticky until the game clears it */
+    rtc->regs[MBC3_RTC_DL - MBC3_RTC_S] = days & 0xff;
+    *dh = (*dh & ~MBC3_RTC_DH_DAY_MSB) | ((days >> 8) & MBC3_RTC_DH_DAY_MSB);
+}
+
+/* one second, out of range values the game wrote count up to the register width and wrap without a carry */
+static void
+rtc_tick(gbc_rtc_t *rtc)
+{
+    uint8_t *r = rtc->regs;
+
+    if (r[0] != 59) {
+        r[0] = (r[0] + 1) & 0x3f;
+        return;
+    }
+    r[0] = 0;
+    if (r[1] != 59) {
+        r[1] = (r[1] + 1) & 0x3f;
+        return;
+    }
+    r[1] = 0;
+    if (r[2] != 23) {
+        r[2] = (r[2] + 1) & 0x1f;
+        return;
+    }
+    r[2] = 0;
+    rtc_set_days(rtc, rtc_days(rtc) + 1);
+}
+
+static void
+rtc_advance(gbc_rtc_t *rtc, uint64_t seconds)
+{
+    uint8_t *r = rtc->regs;
+
+    while (seconds && (r[0] > 59 || r[1] > 59 || r[2] > 23)) {
+        rtc_tick(rtc);
+        seconds--;
+    }
+    if (!seconds)
+        return;
+
+    uint64_t t = r[0] + seconds;
+    r[0] = t % 60;
+    t = r[1] + t / 60;
+    r[1] = t % 60;
+    t = r[2] + t / 60;
+    r[2] = t % 24;
+    t = rtc_days(rtc) + t / 24;
+    /* it only has to know it overflowed */
+    rtc_set_days(rtc, t > 0x1ff ? (t & 0x1ff) | 0x200 : t);
+}
+
+static void
+rtc_sync(gbc_mbc_t *mbc)
+{
+    gbc_rtc_t *rtc = &mbc->rtc;
+    if (!mbc->clocks)
+        return;
+
+    uint64_t elapsed = *mbc->clocks - rtc->clocks;
+    rtc->clocks = *mbc->clocks;
+    if (rtc->regs[MBC3_RTC_DH - MBC3_RTC_S] & MBC3_RTC_DH_HALT)
+        return;
+
+    elapsed += rtc->sub;
+    rtc->sub = elapsed % MBC3_RTC_CLOCKS_PER_SECOND;
+    rtc_advance(rtc, elapsed / MBC3_RTC_CLOCKS_PER_SECOND);
+}
+
+static const uint8_t _rtc_masks[MBC3_RTC_REGS] = {
+    0x3f, 0x3f, 0x1f, 0xff, MBC3_RTC_DH_DAY_MSB | MBC3_RTC_DH_HALT | MBC3_RTC_DH_CARRY
+};
+
+static void
+rtc_write(gbc_mbc_t *mbc, uint8_t reg, uint8_t data)
+{
+    /* the time up to now still counts with the old values */
+    rtc_sync(mbc);
+    mbc->rtc.regs[reg - MBC3_RTC_S] = data & _rtc_masks[reg - MBC3_RTC_S];
+    if (reg == MBC3_RTC_S)
+        mbc->rtc.sub = 0;
+}
+
+static void
+rtc_latch(gbc_mbc_t *mbc, uint8_t data)
+{
+    if (mbc->rtc.latch == 0 && data == 1) {
+        rtc_sync(mbc);
+        memcpy(mbc->rtc.latched, mbc->rtc.regs, MBC3_RTC_REGS);
+    }
+    mbc->rtc.latch = data;
+}
+
+/* the .sav footer, see MBC3_RTC_SAV_SIZE */
+static void
+rtc_load(gbc_rtc_t *rtc, const uint8_t *footer)
+{
+    for (int i = 0; i < MBC3_RTC_REGS; i++) {
+        rtc->regs[i] = footer[i * 4] & _rtc_masks[i];
+        rtc->latched[i] = footer[(MBC3_RTC_REGS + i) * 4] & _rtc_masks[i];
+    }
+}
+
+/* returns 1 if the footer changed */
+static int
+rtc_store(gbc_rtc_t *rtc, uint8_t *footer)
+{
+    uint8_t regs[MBC3_RTC_REGS * 2 * 4];
+
+    memset(regs, 0, sizeof(regs));
+    for (int i = 0; i < MBC3_RTC_REGS; i++) {
+        regs[i * 4] = rtc->regs[i];
+        regs[(MBC3_RTC_REGS + i) * 4] = rtc->latched[i];
+    }
+    if (memcmp(footer, regs, sizeof(regs)) == 0)
+        return 0;
+
+    memcpy(footer, regs, sizeof(regs));
+    /* other emulators move the clock by the time the game was off, this one does not read it */
+    uint64_t now = (uint64_t)time(NULL);
+    for (int i = 0; i < 8; i++)
+        footer[sizeof(regs) + i] = (now >> (i * 8)) & 0xff;
+    return 1;
+}
+
+static void
+mbc3_map(gbc_mbc_t *mbc)
+{
+    uint16_t rom_bank = mbc->rom_bank & MBC3_ROM_BANK_MASK;
+    if (rom_bank == 0) rom_bank = 1;
+
+    /* the clock registers are not memory, they go through the handlers */
+    mbc_map_banks(mbc, rom_bank, mbc->ram_bank <= MBC3_RAM_BANK_MASK ? mbc->ram_bank : 0xff);
+}
+
+void
+gbc_mbc_destroy(gbc_mbc_t *mbc)
+{
+    gbc_mbc_flush(mbc);
+
+    if (mbc->ram_owned)
+        free_memory(mbc->ram_banks);
+    if (mbc->sav.data)
+        unmap_file(&mbc->sav);
+    free_memory(mbc->sav_path);
+
+    mbc->ram_banks = NULL;
+    mbc->sav_path = NULL;
+}
+
+/* ram_size 0 still gets a bank, see mbc_ram_banks, only the MBC2 has RAM without saying so */
+static size_t
+mbc_sav_ram_size(gbc_mbc_t *mbc)
+{
+    uint8_t mbc2 = mbc->type == CART_TYPE_MBC2 || mbc->type == CART_TYPE_MBC2_BATTERY;
+    return mbc->cart->ram_size || mbc2 ? mbc->ram_size : 0;
+}
 
-        return mbc->ram_banks[bank * RAM_BANK_SIZE + raddr];
+size_t
+gbc_mbc_sav_size(gbc_mbc_t *mbc)
+{
+    if (!mbc->cart || !cartridge_has_battery(mbc->cart))
+        return 0;
+    /* a cartridge with a clock but no RAM only keeps the clock */
+    return mbc_sav_ram_size(mbc) + (mbc->has_rtc ? MBC3_RTC_SAV_SIZE : 0);
+}
+
+int
+gbc_mbc_attach_sav(gbc_mbc_t *mbc, const char *path)
+{
+    size_t ram_size = mbc_sav_ram_size(mbc);
+    size_t size = gbc_mbc_sav_size(mbc);
+    char *sav_path = (char*)malloc_memory(strlen(path) + 1);
+    mapped_file_t sav;
+
+    if (!sav_path || map_file_shared(&sav, path, size) != 0) {
+        LOG_ERROR("[MBC] Failed to open %s\n", path);
+        free_memory(sav_path);
+        return 1;
+    }
+    strcpy(sav_path, path);
+
+    /* the .sav is what the cartridge RAM holds now */
+    if (ram_size) {
+        if (mbc->ram_owned)
+            free_memory(mbc->ram_banks);
+        mbc->ram_owned = 0;
+        mbc->ram_banks = sav.data;
+    }
+    mbc->sav = sav;
+    mbc->sav_path = sav_path;
+    memset(mbc->ram_dirty, 0, sizeof(mbc->ram_dirty));
+    mbc->ram_dirty_any = 0;
+
+    if (mbc->has_rtc) {
+        rtc_load(&mbc->rtc, sav.data + ram_size);
+        mbc->rtc.sub = 0;
+        if (mbc->clocks)
+            mbc->rtc.clocks = *mbc->clocks;
+    }
+
+    if (mbc->mem)
+        mbc_remap(mbc);
+
+    LOG_INFO("[MBC] External RAM is kept in %s%s\n", path, sav.mapped ? "" : " (not mapped)");
+    return 0;
+}
+
+void
+gbc_mbc_mark_ram(gbc_mbc_t *mbc, uint32_t offset)
+{
+    if (!mbc_ram_in_sav(mbc))
+        return;
+    mbc->ram_dirty[offset >> MEMORY_PAGE_SHIFT] = 1;
+    mbc->ram_dirty_any = 1;
+}
+
+void
+gbc_mbc_flush(gbc_mbc_t *mbc)
+{
+    mbc->flush_frames = 0;
+    if (!mbc->sav.data)
+        return;
+
+    if (mbc->has_rtc) {
+        size_t offset = mbc->sav.size - MBC3_RTC_SAV_SIZE;
+        rtc_sync(mbc);
+        if (rtc_store(&mbc->rtc, mbc->sav.data + offset) &&
+            sync_file(&mbc->sav, mbc->sav_path, offset, MBC3_RTC_SAV_SIZE) != 0)
+            LOG_ERROR("[MBC] Failed to write %s\n", mbc->sav_path);
     }
 
-    LOG_ERROR("[MBC1] Invalid read: addr: %x\n", addr);
+    if (!mbc_ram_in_sav(mbc) || !mbc->ram_dirty_any)
+        return;
+
+    /* one sync over the dirty range, the pages in between are clean and cost nothing to msync */
+    uint32_t pages = mbc->ram_size >> MEMORY_PAGE_SHIFT;
+    uint32_t first = pages, last = 0;
+    for (uint32_t i = 0; i < pages; i++) {
+        if (mbc->ram_dirty[i]) {
+            if (first == pages)
+                first = i;
+            last = i;
+        }
+    }
+
+    if (first < pages && sync_file(&mbc->sav, mbc->sav_path, first << MEMORY_PAGE_SHIFT,
+                                   (last - first + 1) << MEMORY_PAGE_SHIFT) != 0)
+        LOG_ERROR("[MBC] Failed to write %s\n", mbc->sav_path);
+
+    memset(mbc->ram_dirty, 0, sizeof(mbc->ram_dirty));
+    mbc->ram_dirty_any = 0;
+
+    /* protect the pages again */
+    if (mbc->mem)
+        mbc->map(mbc);
+}
+
+uint8_t
+mbc1_read(gbc_mbc_t *mbc, uint16_t addr)
+{
+    /* ROM and the valid RAM banks are read through mbc->rom_bank_n_ptr/ram_bank_ptr, see mbc_read */
+    uint8_t bank = (translate_mbc1_addr(mbc, addr) >> RAM_ADDR_MASK_SHIFT) & MBC1_RAM_BANK_MASK;
+
+    LOG_ERROR("[MBC1] Invalid read: addr: %x. Trying to read from invalid RAM bank: %d, bank_size: %d\n",
+                addr, bank, mbc->ram_bank_size);
     abort();
 }
 
@@ -285,7 +783,7 @@ mbc1_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
                             addr, data, bank, mbc->ram_bank_size);
                 abort();
             }
-            mbc->ram_banks[bank * RAM_BANK_SIZE + raddr] = data;
+            mbc_ram_write(mbc, bank * RAM_BANK_SIZE + raddr, data);
             result = data;
         }
 
@@ -300,44 +798,11 @@ mbc1_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
 uint8_t
 mbc5_read(gbc_mbc_t *mbc, uint16_t addr)
 {
-    LOG_DEBUG("[MBC5] Reading from MBC5 at address %x\n", addr);
-
-    if (IN_RANGE(addr, MBC1_ROM_BANK0_BEGIN, MBC1_ROM_BANK0_END)) {
-        return mbc->rom_banks[addr];
-
-    } else if (IN_RANGE(addr, MBC1_ROM_BANK_N_BEGIN, MBC1_ROM_BANK_N_END)) {
-        uint32_t mbc5_rom_addr = translate_mbc5_addr(mbc, addr);
-        uint16_t raddr = mbc5_rom_addr & ROM_ADDR_MASK;
-        uint8_t bank = (mbc5_rom_addr >> ROM_ADDR_MASK_SHIFT) & MBC5_ROM_BANK_MASK;
-
-        LOG_DEBUG("[MBC5] Reading from MBC5 ROM Bank [%x] at address %x\n", bank, raddr);
-
-        if (bank >= mbc->rom_bank_size) {
-            LOG_ERROR("[MBC5] Invalid read: addr: %x. Trying to read from invalid ROM bank: %d, bank_size: %d\n",
-                        addr, bank, mbc->rom_bank_size);
-            // this crashes some blargg's test roms, dont know why
-            //abort();
-        }
+    /* ROM and the valid RAM banks are read through mbc->rom_bank_n_ptr/ram_bank_ptr, see mbc_read */
+    uint8_t bank = mbc->ram_bank & MBC5_RAM_BANK_MASK;
 
-        return mbc->rom_banks[bank * ROM_BANK_SIZE + raddr];
-
-    } else if (IN_RANGE(addr, MBC1_RAM_BEGIN, MBC1_RAM_END)) {
-        uint32_t mbc5_ram_addr = translate_mbc5_addr(mbc, addr);
-        uint16_t raddr = mbc5_ram_addr & RAM_ADDR_MASK;
-        uint8_t bank = (mbc5_ram_addr >> RAM_ADDR_MASK_SHIFT) & MBC5_RAM_BANK_MASK;
-
-        LOG_DEBUG("[MBC5] Reading from MBC5 RAM Bank [%x] at address %x\n", bank, raddr);
-
-        if (bank >= mbc->ram_bank_size) {
-            LOG_ERROR("[MBC5] Invalid read: addr: %x. Trying to read from invalid RAM bank: %d, bank_size: %d\n",
-                        addr, bank, mbc->ram_bank_size);
-            abort();
-        }
-
-        return mbc->ram_banks[bank * RAM_BANK_SIZE + raddr];
-    }
-
-    LOG_ERROR("[MBC5] Invalid read: addr: %x\n", addr);
+    LOG_ERROR("[MBC5] Invalid read: addr: %x. Trying to read from invalid RAM bank: %d, bank_size: %d\n",
+                addr, bank, mbc->ram_bank_size);
     abort();
 }
 
@@ -361,6 +826,13 @@ mbc5_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
             mbc->rom_bank = (mbc->rom_bank & ~0x100) | ((data & MBC5_REG_ROM_BANK_MSB_MASK) << MBC5_REG_ROM_BANK_MSB_SHIFT);
             LOG_DEBUG("[MBC5] Set ROM bank MSB: %x %x\n",  (data & MBC5_REG_ROM_BANK_MSB_MASK), mbc->rom_bank);
         } else if (IN_RANGE(addr, MBC1_REG_RAM_BANK_BEGIN, MBC1_REG_RAM_BANK_END)) {
+            if (mbc->has_rumble) {
+                uint8_t rumbling = (data & MBC5_RUMBLE_MOTOR) != 0;
+                if (rumbling != mbc->rumbling && mbc->rumble)
+                    mbc->rumble(mbc->rumble_udata, rumbling);
+                mbc->rumbling = rumbling;
+                data &= MBC5_RUMBLE_RAM_BANK_MASK;
+            }
             result = data & MBC5_RAM_BANK_MASK;
             mbc->ram_bank = result;
             LOG_DEBUG("[MBC5] Set RAM bank: %d\n", mbc->ram_bank);
@@ -391,7 +863,7 @@ mbc5_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
                             addr, data, bank, mbc->ram_bank_size);
                 abort();
             }
-            mbc->ram_banks[bank * RAM_BANK_SIZE + raddr] = data;
+            mbc_ram_write(mbc, bank * RAM_BANK_SIZE + raddr, data);
             result = data;
         }
 
@@ -406,18 +878,193 @@ mbc5_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
 uint8_t
 mbc3_read(gbc_mbc_t *mbc, uint16_t addr)
 {
-    LOG_DEBUG("[MBC3] Reading from MBC3 at address %x\n", addr);
-    /* TODO */
-    assert(0);
-    return 0;
+    /* ROM and the valid RAM banks are read through mbc->rom_bank_n_ptr/ram_bank_ptr, see mbc_read */
+    uint8_t bank = mbc->ram_bank;
+
+    if (IN_RANGE(bank, MBC3_RTC_S, MBC3_RTC_DH)) {
+        /* the game reads the latched copy, the counters keep going */
+        if (!mbc->has_rtc || !mbc->ram_enabled)
+            return 0xff;
+        return mbc->rtc.latched[bank - MBC3_RTC_S];
+    }
+
+    LOG_ERROR("[MBC3] Invalid read: addr: %x. Trying to read from invalid RAM bank: %d, bank_size: %d\n",
+                addr, bank, mbc->ram_bank_size);
+    abort();
 }
 
 uint8_t
 mbc3_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
 {
     LOG_DEBUG("[MBC3] Writing to MBC3 at address %x [%x]\n", addr, data);
-    /* TODO */
-    assert(0);
+
+    if (IN_RANGE(addr, MBC1_ROM_BEGIN, MBC1_ROM_END)) {
+
+        if (IN_RANGE(addr, MBC1_REG_RAM_ENABLE_BEGIN, MBC1_REG_RAM_ENABLE_END)) {
+            /* the clock registers too */
+            mbc->ram_enabled = ((data & 0x0f) == MBC1_RAM_ENABLE);
+            LOG_DEBUG("[MBC3] RAM enabled: %d\n", mbc->ram_enabled);
+
+        } else if (IN_RANGE(addr, MBC1_REG_ROM_BANK_BEGIN, MBC1_REG_ROM_BANK_END)) {
+            mbc->rom_bank = data & MBC3_ROM_BANK_MASK;
+            if (mbc->rom_bank == 0) mbc->rom_bank = 1;
+            LOG_DEBUG("[MBC3] Set ROM bank: %d\n", mbc->rom_bank);
+
+        } else if (IN_RANGE(addr, MBC1_REG_RAM_BANK_BEGIN, MBC1_REG_RAM_BANK_END)) {
+            /* 0x00 - 0x07 a RAM bank, 0x08 - 0x0c a clock register */
+            mbc->ram_bank = data;
+            LOG_DEBUG("[MBC3] Set RAM bank: %d\n", mbc->ram_bank);
+
+        } else if (IN_RANGE(addr, MBC3_REG_LATCH_BEGIN, MBC3_REG_LATCH_END)) {
+            if (mbc->has_rtc)
+                rtc_latch(mbc, data);
+
+        } else {
+            LOG_ERROR("[MBC3] It is not possible to reach here: %x\n", addr);
+            abort();
+        }
+
+    } else if (IN_RANGE(addr, MBC1_RAM_BEGIN, MBC1_RAM_END)) {
+        uint8_t bank = mbc->ram_bank;
+
+        /* external RAM */
+        if (!mbc->ram_enabled) {
+            LOG_INFO("[MBC3] Invalid write: addr %x data: [%x]. External RAM is not enabled. This write is ignored.\n", addr, data);
+
+        } else if (IN_RANGE(bank, MBC3_RTC_S, MBC3_RTC_DH)) {
+            if (mbc->has_rtc)
+                rtc_write(mbc, bank, data);
+
+        } else {
+            LOG_DEBUG("[MBC3] Writing to MBC3 RAM Bank [%x] at address %x [%x]\n", bank, addr, data);
+
+            if (bank >= mbc->ram_bank_size) {
+                LOG_ERROR("[MBC3] Invalid write: addr: %x data: [%x]. Trying to write to invalid RAM bank: %d, bank_size: %d\n",
+                            addr, data, bank, mbc->ram_bank_size);
+                abort();
+            }
+            mbc_ram_write(mbc, bank * RAM_BANK_SIZE + (addr & RAM_ADDR_MASK), data);
+        }
+
+    } else {
+        LOG_ERROR("[MBC3] Invalid write: addr: %x data: [%x]", addr, data);
+        abort();
+    }
+
+    return data;
+}
+
+/* no MBC, 32KB of ROM and maybe 8KB of RAM */
+uint8_t
+rom_only_read(gbc_mbc_t *mbc, uint16_t addr)
+{
+    /* ROM and RAM are read through mbc->rom_bank_n_ptr/ram_bank_ptr, see mbc_read */
+    LOG_ERROR("[ROM] Invalid read: addr: %x\n", addr);
+    abort();
+}
+
+uint8_t
+rom_only_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    /* RAM is written through mbc->ram_bank_ptr, see mbc_write */
+    if (addr <= ROM_BANK_N_END) {
+        LOG_DEBUG("[ROM] Write to ROM is ignored: addr: %x data: [%x]\n", addr, data);
+        return data;
+    }
+
+    LOG_ERROR("[ROM] Invalid write: addr: %x data: [%x]\n", addr, data);
+    abort();
+}
+
+/* https://gbdev.io/pandocs/MBC2.html */
+uint8_t
+mbc2_read(gbc_mbc_t *mbc, uint16_t addr)
+{
+    /* only before the pages are mapped, see mbc2_map */
+    return mbc->ram_banks[addr & MBC2_RAM_MASK];
+}
+
+uint8_t
+mbc2_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    LOG_DEBUG("[MBC2] Writing to MBC2 at address %x [%x]\n", addr, data);
+
+    if (IN_RANGE(addr, MBC2_REG_BEGIN, MBC2_REG_END)) {
+        if (addr & MBC2_REG_ROM_BANK_BIT) {
+            mbc->rom_bank = data & MBC2_ROM_BANK_MASK;
+            if (mbc->rom_bank == 0) mbc->rom_bank = 1;
+            LOG_DEBUG("[MBC2] Set ROM bank: %d\n", mbc->rom_bank);
+        } else {
+            mbc->ram_enabled = ((data & 0x0f) == MBC1_RAM_ENABLE);
+            LOG_DEBUG("[MBC2] RAM enabled: %d\n", mbc->ram_enabled);
+        }
+
+    } else if (IN_RANGE(addr, MBC1_RAM_BEGIN, MBC1_RAM_END)) {
+        if (!mbc->ram_enabled) {
+            LOG_INFO("[MBC2] Invalid write: addr %x data: [%x]. External RAM is not enabled. This write is ignored.\n", addr, data);
+        } else {
+            /* only the lower 4 bits exist */
+            mbc_ram_write(mbc, addr & MBC2_RAM_MASK, data | MBC2_RAM_UNUSED_BITS);
+        }
+
+    } else if (addr > ROM_BANK_N_END) {
+        LOG_ERROR("[MBC2] Invalid write: addr: %x data: [%x]", addr, data);
+        abort();
+    }
+
     return data;
 }
 
+/* https://gbdev.io/pandocs/HuC1.html */
+uint8_t
+huc1_read(gbc_mbc_t *mbc, uint16_t addr)
+{
+    /* ROM and the valid RAM banks are read through mbc->rom_bank_n_ptr/ram_bank_ptr, see mbc_read */
+    if (mbc->mode) {
+        /* nobody is sending anything */
+        return HUC1_IR_NO_LIGHT;
+    }
+
+    LOG_ERROR("[HuC1] Invalid read: addr: %x. Trying to read from invalid RAM bank: %d, bank_size: %d\n",
+                addr, mbc->ram_bank & HUC1_RAM_BANK_MASK, mbc->ram_bank_size);
+    abort();
+}
+
+uint8_t
+huc1_write(gbc_mbc_t *mbc, uint16_t addr, uint8_t data)
+{
+    LOG_DEBUG("[HuC1] Writing to HuC1 at address %x [%x]\n", addr, data);
+
+    if (IN_RANGE(addr, MBC1_REG_RAM_ENABLE_BEGIN, MBC1_REG_RAM_ENABLE_END)) {
+        /* there is no RAM enable, only the infrared port replaces the RAM */
+        mbc->mode = (data & 0x0f) == HUC1_IR_SELECT;
+        mbc->ram_enabled = !mbc->mode;
+        LOG_DEBUG("[HuC1] Infrared mode: %d\n", mbc->mode);
+
+    } else if (IN_RANGE(addr, MBC1_REG_ROM_BANK_BEGIN, MBC1_REG_ROM_BANK_END)) {
+        mbc->rom_bank = data & HUC1_ROM_BANK_MASK;
+        LOG_DEBUG("[HuC1] Set ROM bank: %d\n", mbc->rom_bank);
+
+    } else if (IN_RANGE(addr, MBC1_REG_RAM_BANK_BEGIN, MBC1_REG_RAM_BANK_END)) {
+        mbc->ram_bank = data & HUC1_RAM_BANK_MASK;
+        LOG_DEBUG("[HuC1] Set RAM bank: %d\n", mbc->ram_bank);
+
+    } else if (IN_RANGE(addr, MBC1_REG_BANKING_MODE_BEGIN, MBC1_REG_BANKING_MODE_END)) {
+        /* nothing there */
+
+    } else if (IN_RANGE(addr, MBC1_RAM_BEGIN, MBC1_RAM_END)) {
+        if (mbc->mode) {
+            /* the infrared LED, there is nobody to see it */
+        } else {
+            LOG_ERROR("[HuC1] Invalid write: addr: %x data: [%x]. Trying to write to invalid RAM bank: %d, bank_size: %d\n",
+                        addr, data, mbc->ram_bank, mbc->ram_bank_size);
+            abort();
+        }
+
+    } else {
+        LOG_ERROR("[HuC1] Invalid write: addr: %x data: [%x]", addr, data);
+        abort();
+    }
+
+    return data;
+}
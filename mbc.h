@@ -4,12 +4,15 @@
 #include "common.h"
 #include "memory.h"
 #include "cartridge.h"
+#include "rom_cache.h"
 
 #define MAX_ROM_BANKS 512
 #define MAX_RAM_BANKS 16
 #define ROM_BANK_SIZE 0x4000    /* 16KB */
 #define RAM_BANK_SIZE 0x2000    /* 8KB */
 
+#define MBC_FLUSH_INTERVAL 300  /* frames, 5 seconds */
+
 #define MBC1_ROM_BEGIN 0x0000
 #define MBC1_ROM_END   0x7fff
 
@@ -57,9 +60,68 @@
 #define MBC5_REG_ROM_BANK_MSB_MASK 0x1
 #define MBC5_REG_ROM_BANK_MSB_SHIFT 8
 
+/* MBC5 with a motor, bit 3 of the RAM bank register drives it */
+#define MBC5_RUMBLE_RAM_BANK_MASK   0x07
+#define MBC5_RUMBLE_MOTOR           0x08
+
+/* MBC2, the bit 8 of the address picks the register in 0x0000 - 0x3fff */
+#define MBC2_REG_BEGIN          0x0000
+#define MBC2_REG_END            0x3fff
+#define MBC2_REG_ROM_BANK_BIT   0x0100
+#define MBC2_ROM_BANK_MASK      0x0f
+#define MBC2_RAM_SIZE           0x200   /* 512 x 4 bits, built into the chip */
+#define MBC2_RAM_MASK           (MBC2_RAM_SIZE - 1)
+#define MBC2_RAM_UNUSED_BITS    0xf0    /* read as 1 */
+
+/* HuC1, 0x0e in the RAM enable register switches 0xa000 - 0xbfff to the infrared port */
+#define HUC1_IR_SELECT          0x0e
+#define HUC1_ROM_BANK_MASK      0x3f
+#define HUC1_RAM_BANK_MASK      0x03
+#define HUC1_IR_NO_LIGHT        0xc0
+
+#define MBC3_REG_LATCH_BEGIN    0x6000
+#define MBC3_REG_LATCH_END      0x7fff
+
+#define MBC3_ROM_BANK_MASK      0x7f
+#define MBC3_RAM_BANK_MASK      0x07    /* the MBC30 has 8 banks */
+
+/* RAM bank numbers selecting the clock registers */
+#define MBC3_RTC_S              0x08
+#define MBC3_RTC_M              0x09
+#define MBC3_RTC_H              0x0a
+#define MBC3_RTC_DL             0x0b
+#define MBC3_RTC_DH             0x0c
+#define MBC3_RTC_REGS           5
+
+#define MBC3_RTC_DH_DAY_MSB     0x01
+#define MBC3_RTC_DH_HALT        0x40
+#define MBC3_RTC_DH_CARRY       0x80
+
+/* the 32768Hz crystal, counted in base clocks so it does not depend on the host */
+#define MBC3_RTC_CLOCKS_PER_SECOND 4194304
+
+/* appended to the .sav, the layout most emulators use: 5 registers, 5 latched registers (32 bits each) and a 64 bit unix time */
+#define MBC3_RTC_SAV_SIZE       48
+
 typedef struct gbc_mbc gbc_mbc_t;
+typedef struct gbc_rtc gbc_rtc_t;
 typedef uint8_t (*mbc_read_func)(gbc_mbc_t *mbc, uint16_t addr);
 typedef uint8_t (*mbc_write_func)(gbc_mbc_t *mbc, uint16_t addr, uint8_t data);
+typedef void (*mbc_map_func)(gbc_mbc_t *mbc);
+typedef void (*mbc_rumble_func)(void *udata, uint8_t on);
+
+/*
+  MBC3 real time clock, it only moves with the emulated clock so runs are
+  deterministic and it does not move while the emulator is not running.
+*/
+struct gbc_rtc
+{
+    uint8_t regs[MBC3_RTC_REGS];    /* S, M, H, DL, DH */
+    uint8_t latched[MBC3_RTC_REGS]; /* what the game reads */
+    uint8_t latch;                  /* last write to the latch register, 0 then 1 latches */
+    uint64_t clocks;                /* the clock regs have been brought up to */
+    uint32_t sub;                   /* clocks into the current second */
+};
 
 struct gbc_mbc
 {
@@ -67,28 +129,61 @@ struct gbc_mbc
     uint16_t rom_bank_size;
     uint8_t ram_bank;
     uint8_t ram_bank_size;
+    uint32_t ram_size;      /* bytes, MBC2 only has 512 */
     uint8_t ram_enabled;
-    uint8_t mode;
+    uint8_t mode;           /* MBC1 banking mode, HuC1 infrared mode */
     uint8_t type;
 
     mbc_read_func read;
     mbc_write_func write;
+    mbc_map_func map;       /* maps the current ROM/RAM banks onto the bus pages */
 
     gbc_memory_t *mem;
     cartridge_t *cart;
 
-    uint8_t *rom_banks;
+    uint8_t *rom_banks;     /* read only, it points into rom */
+    uint8_t *rom_bank_n_ptr;    /* the bank at 0x4000, set by map */
+    uint8_t *ram_bank_ptr;      /* the bank at 0xa000, NULL if it is a clock register or a bank the cartridge does not have */
+    gbc_rom_t *rom;
 
     /*
-    * We should dynmically allocate these space, but considering the future plan
-    * of running the emulator on a bare-metal RPi(with no OS, thus no malloc), I
-    * chose to use static arrays.
+      ram_size bytes, malloc'ed or the mapped .sav of a battery backed cartridge,
+      see gbc_mbc_attach_sav. The first write to a clean page of a .sav goes through
+      the handlers to mark it dirty, gbc_mbc_flush writes the dirty pages back.
     */
-    uint8_t ram_banks[MAX_RAM_BANKS * RAM_BANK_SIZE];
+    uint8_t *ram_banks;
+    uint8_t ram_owned;          /* malloc'ed by gbc_mbc_init_with_cart */
+    mapped_file_t sav;
+    char *sav_path;
+    uint8_t ram_dirty[(MAX_RAM_BANKS * RAM_BANK_SIZE) >> MEMORY_PAGE_SHIFT];
+    uint8_t ram_dirty_any;
+    uint32_t flush_interval;    /* frames between gbc_mbc_flush, 0 only flushes in gbc_destroy */
+    uint32_t flush_frames;      /* since the last flush */
+
+    uint8_t has_rtc;
+    gbc_rtc_t rtc;
+    const uint64_t *clocks;     /* base clocks of the machine, the rtc counts them */
+
+    uint8_t has_rumble;
+    uint8_t rumbling;
+    mbc_rumble_func rumble;     /* optional, called when the motor is switched on or off */
+    void *rumble_udata;
 };
 
 void gbc_mbc_init(gbc_mbc_t *mbc);
 void gbc_mbc_connect(gbc_mbc_t *mbc, gbc_memory_t *mem);
-void gbc_mbc_init_with_cart(gbc_mbc_t *mbc, cartridge_t *cart);
+/* bytes of external RAM the cartridge needs */
+size_t gbc_mbc_ram_size(cartridge_t *cart);
+/* ram is gbc_mbc_ram_size bytes, NULL mallocs it */
+void gbc_mbc_init_with_cart(gbc_mbc_t *mbc, cartridge_t *cart, uint8_t *ram);
+void gbc_mbc_destroy(gbc_mbc_t *mbc);
+/* bytes of the .sav, 0 if the cartridge has nothing to keep */
+size_t gbc_mbc_sav_size(gbc_mbc_t *mbc);
+/* keeps the external RAM and the clock (if any) in a .sav file, returns 0 on success */
+int gbc_mbc_attach_sav(gbc_mbc_t *mbc, const char *path);
+/* the page of the external RAM offset changed behind the handlers' back (e.g. a state was loaded) */
+void gbc_mbc_mark_ram(gbc_mbc_t *mbc, uint32_t offset);
+/* writes the dirty pages and the clock of the .sav back */
+void gbc_mbc_flush(gbc_mbc_t *mbc);
 
 #endif
\ No newline at end of file
@@ -1,47 +1,82 @@
 #include "memory.h"
 #include "graphic.h"
 
-memory_map_entry_t*
-select_entry(gbc_memory_t *mem, uint16_t addr)
+static inline memory_map_entry_t*
+dispatch_entry(gbc_memory_t *mem, memory_page_t *page, uint16_t addr)
 {
-    for (int i = 0; i < MEMORY_MAP_ENTRIES; i++) {
-        memory_map_entry_t *entry = &(mem->map[i]);
-        if (addr >= entry->addr_begin && addr <= entry->addr_end) {
-            if (entry->id == 0) {
-                return NULL;
-            }
-            return entry;
-        }
-    }
+    if (page->entry)
+        return page->entry;
+    if (addr >= MEMORY_SHARED_BEGIN)
+        return mem->shared_entries[addr - MEMORY_SHARED_BEGIN];
+    /* entries below the shared pages cover whole pages, nothing is mapped here */
     return NULL;
 }
 
+/* OAM, IO ports and IE, HRAM is private to the cpu */
+#define MEMORY_NEEDS_SYNC(addr) ((addr) >= OAM_BEGIN && !IN_RANGE((addr), HRAM_BEGIN, HRAM_END))
+
+static void unprotect_wram_code(gbc_memory_t *mem, const uint8_t *host);
+
 static uint8_t
 mem_write(void *udata, uint16_t addr, uint8_t data)
 {
     LOG_DEBUG("[MEM] Writing to memory at address %x [%x]\n", addr, data);
     gbc_memory_t *mem = (gbc_memory_t*)udata;
-    memory_map_entry_t *entry = select_entry(mem, addr);
+    memory_page_t *page = &(mem->pages[addr >> MEMORY_PAGE_SHIFT]);
+
+    if (page->write) {
+        page->write[addr & MEMORY_PAGE_MASK] = data;
+        return data;
+    }
+
+    /* HRAM has no page of its own, the stack lives there */
+    if (IN_RANGE(addr, HRAM_BEGIN, HRAM_END)) {
+        mem->hraw[addr - HRAM_BEGIN] = data;
+        return data;
+    }
+
+    memory_map_entry_t *entry = dispatch_entry(mem, page, addr);
 
     if (entry == NULL) {
         LOG_ERROR("[MEM] No memory map entry found for address %x\n", addr);
         abort();
     }
 
-    return entry->write(entry->udata, addr, data);
+    if (mem->sync && (IN_RANGE(addr, VRAM_BEGIN, VRAM_END) || MEMORY_NEEDS_SYNC(addr)))
+        mem->sync(mem->sync_udata, 1);
+
+    data = entry->write(entry->udata, addr, data);
+
+    /* readable but not writable directly, it may be a WRAM page with cached code */
+    if (page->read)
+        unprotect_wram_code(mem, page->read + (addr & MEMORY_PAGE_MASK));
+
+    return data;
 }
 
 static uint8_t
 mem_read(void *udata, uint16_t addr)
 {
     gbc_memory_t *mem = (gbc_memory_t*)udata;
-    memory_map_entry_t *entry = select_entry(mem, addr);
+    memory_page_t *page = &(mem->pages[addr >> MEMORY_PAGE_SHIFT]);
+
+    if (page->read) {
+        return page->read[addr & MEMORY_PAGE_MASK];
+    }
+
+    if (IN_RANGE(addr, HRAM_BEGIN, HRAM_END))
+        return mem->hraw[addr - HRAM_BEGIN];
+
+    memory_map_entry_t *entry = dispatch_entry(mem, page, addr);
 
     if (entry == NULL) {
         LOG_ERROR("[MEM] No memory map entry found for address %x\n", addr);
         abort();
     }
 
+    if (mem->sync && MEMORY_NEEDS_SYNC(addr))
+        mem->sync(mem->sync_udata, 0);
+
     uint8_t data = entry->read(entry->udata, addr);
     LOG_DEBUG("[MEM] Reading from memory at address %x [%x]\n", addr, data);
 
@@ -82,7 +117,122 @@ register_memory_map(gbc_memory_t *mem, memory_map_entry_t *entry)
         }
     }
 
+    /* below the shared pages an entry has to cover whole pages, see dispatch_entry */
+    if (entry->addr_begin < MEMORY_SHARED_BEGIN &&
+        ((entry->addr_begin & MEMORY_PAGE_MASK) != 0 || (entry->addr_end & MEMORY_PAGE_MASK) != MEMORY_PAGE_MASK)) {
+        LOG_ERROR("[MEM] Memory map entry id %d does not cover whole pages [%x] - [%x]\n", entry->id, entry->addr_begin, entry->addr_end);
+        abort();
+    }
+
     mem->map[entry->id-1] = *entry;
+
+    /* a page is dispatched straight to its entry only when the entry covers the whole page,
+       the shared pages are dispatched per address */
+    for (int i = entry->addr_begin >> MEMORY_PAGE_SHIFT; i <= entry->addr_end >> MEMORY_PAGE_SHIFT; i++) {
+        memory_page_t *page = &mem->pages[i];
+        uint16_t page_begin = i << MEMORY_PAGE_SHIFT;
+        uint16_t page_end = page_begin | MEMORY_PAGE_MASK;
+
+        page->read = page->write = NULL;
+        if (entry->addr_begin <= page_begin && entry->addr_end >= page_end)
+            page->entry = &mem->map[entry->id-1];
+        else
+            page->entry = NULL;
+    }
+
+    uint32_t addr = entry->addr_begin > MEMORY_SHARED_BEGIN ? entry->addr_begin : MEMORY_SHARED_BEGIN;
+    for (; addr <= entry->addr_end; addr++)
+        mem->shared_entries[addr - MEMORY_SHARED_BEGIN] = &mem->map[entry->id-1];
+
+    remap_memory_map(mem, entry->id);
+}
+
+void
+remap_memory_map(gbc_memory_t *mem, uint16_t id)
+{
+    memory_map_entry_t *entry = &mem->map[id-1];
+    if (entry->id && entry->remap)
+        entry->remap(entry->udata);
+}
+
+/* reinstalls the pages of every entry, e.g. after the banking registers have been restored */
+void
+remap_memory(gbc_memory_t *mem)
+{
+    for (int id = 1; id <= MEMORY_MAP_ENTRIES; id++)
+        remap_memory_map(mem, id);
+}
+
+/* index of the WRAM page holding a host address, -1 if it is not in WRAM */
+static int
+wram_page_index(gbc_memory_t *mem, const uint8_t *host)
+{
+    if (host < mem->wram || host >= mem->wram + sizeof(mem->wram))
+        return -1;
+    return (host - mem->wram) >> MEMORY_PAGE_SHIFT;
+}
+
+/*
+    Installs host pointers for the pages in [begin, end], both must be page aligned.
+    'read' and 'write' point to the host memory of 'begin', pass NULL to route the
+    accesses to the handler of the entry (e.g. writes to ROM are MBC registers).
+*/
+void
+map_memory_pages(gbc_memory_t *mem, uint16_t begin, uint16_t end, uint8_t *read, uint8_t *write)
+{
+    assert((begin & MEMORY_PAGE_MASK) == 0 && (end & MEMORY_PAGE_MASK) == MEMORY_PAGE_MASK);
+
+    for (int i = begin >> MEMORY_PAGE_SHIFT; i <= end >> MEMORY_PAGE_SHIFT; i++) {
+        memory_page_t *page = &mem->pages[i];
+        size_t offset = (i << MEMORY_PAGE_SHIFT) - begin;
+        page->read = read ? read + offset : NULL;
+        page->write = write ? write + offset : NULL;
+
+        /* pages with cached code are write protected, the writes have to invalidate the code */
+        int idx = page->write ? wram_page_index(mem, page->write) : -1;
+        if (idx >= 0 && mem->wram_code[idx])
+            page->write = NULL;
+    }
+
+    mem->map_generation++;
+}
+
+static void
+remap_wram(gbc_memory_t *mem)
+{
+    remap_memory_map(mem, WRAM_BANK_0_ID);
+    remap_memory_map(mem, WRAM_BANK_N_ID);
+    remap_memory_map(mem, WRAM_ECHO_ID);
+}
+
+/* the cpu has cached code from this WRAM location */
+void
+protect_wram_code(gbc_memory_t *mem, const uint8_t *host)
+{
+    int idx = wram_page_index(mem, host);
+
+    assert(idx >= 0);
+    if (mem->wram_code[idx])
+        return;
+
+    mem->wram_code[idx] = 1;
+    remap_wram(mem);
+}
+
+/* a write went through a protected page, drop the code cached from it */
+static void
+unprotect_wram_code(gbc_memory_t *mem, const uint8_t *host)
+{
+    int idx = wram_page_index(mem, host);
+
+    if (idx < 0 || !mem->wram_code[idx])
+        return;
+
+    mem->wram_code[idx] = 0;
+    remap_wram(mem);
+
+    if (mem->invalidate)
+        mem->invalidate(mem->invalidate_udata, mem->wram + (idx << MEMORY_PAGE_SHIFT));
 }
 
 static uint8_t
@@ -137,13 +287,52 @@ mem_echo_read(void *udata, uint16_t addr)
     return mem->read(mem, addr);
 }
 
+static inline uint8_t*
+wram_bank_n(gbc_memory_t *mem)
+{
+    uint8_t bank = IO_PORT_READ(mem, IO_PORT_SVBK) & 0x7;
+    if (bank == 0) {
+        /* a value of 00h will select Bank 1 either. */
+        bank = 1;
+    }
+    return mem->wram + bank * WRAM_BANK_SIZE;
+}
+
+static void
+wram_bank_0_remap(void *udata)
+{
+    gbc_memory_t *mem = (gbc_memory_t*)udata;
+    map_memory_pages(mem, WRAM_BANK_0_BEGIN, WRAM_BANK_0_END, mem->wram, mem->wram);
+}
+
+static void
+wram_bank_n_remap(void *udata)
+{
+    gbc_memory_t *mem = (gbc_memory_t*)udata;
+    uint8_t *bank = wram_bank_n(mem);
+    map_memory_pages(mem, WRAM_BANK_N_BEGIN, WRAM_BANK_N_END, bank, bank);
+}
+
+static void
+mem_echo_remap(void *udata)
+{
+    /* 0xE000 - 0xFDFF mirrors 0xC000 - 0xDDFF */
+    gbc_memory_t *mem = (gbc_memory_t*)udata;
+    uint8_t *bank = wram_bank_n(mem);
+    uint16_t bank_n_begin = WRAM_ECHO_BEGIN + WRAM_BANK_SIZE;
+    map_memory_pages(mem, WRAM_ECHO_BEGIN, bank_n_begin - 1, mem->wram, mem->wram);
+    map_memory_pages(mem, bank_n_begin, WRAM_ECHO_END, bank, bank);
+}
+
 static uint8_t
 io_port_read(void *udata, uint16_t addr)
 {
     LOG_DEBUG("[MEM] Reading from IO port at address %x\n", addr);
     uint8_t port = IO_ADDR_PORT(addr);
     gbc_memory_t *mem = (gbc_memory_t*)udata;
-    if (port == IO_PORT_BCPD_BGPD) {
+    if (mem->dmg && IO_PORT_CGB_ONLY(port)) {
+        return 0xff;
+    } else if (port == IO_PORT_BCPD_BGPD) {
         return *((uint8_t*)(mem->bg_palette) + (IO_PORT_READ(mem, IO_PORT_BCPS_BCPI) & 0x3f));
     } else if (port == IO_PORT_OCPD_OBPD) {
         return *((uint8_t*)(mem->obj_palette) + (IO_PORT_READ(mem, IO_PORT_OCPS_OCPI) & 0x3f));
@@ -205,6 +394,11 @@ io_port_write(void *udata, uint16_t addr, uint8_t data)
 
     gbc_memory_t *mem = (gbc_memory_t*)udata;
 
+    if (mem->dmg && IO_PORT_CGB_ONLY(port)) {
+        /* the banks stay at 0 and 1 */
+        return data;
+    }
+
     #if LOGLEVEL == LOG_LEVEL_DEBUG
     if (port == IO_PORT_TAC) {
         LOG_DEBUG("[Timer] Writing to TAC register [%x]\n", data);
@@ -224,8 +418,11 @@ io_port_write(void *udata, uint16_t addr, uint8_t data)
         data = 0;
     } else if (port == IO_PORT_DISABLE_BOOT_ROM) {
         /* Writing 0x11 to this register disables the boot ROM */
-        if (data == 0x11) {
+        if (data == 0x11 && mem->boot_rom_enabled) {
             mem->boot_rom_enabled = 0;
+            IO_PORT_WRITE(mem, port, data);
+            /* the cartridge ROM becomes directly readable */
+            remap_memory_map(mem, ROM_BANK_0_ID);
         }
     } else if (port == IO_PORT_P1) {
         /* https://gbdev.io/pandocs/Joypad_Input.html#ff00--p1joyp-joypad */
@@ -257,8 +454,14 @@ io_port_write(void *udata, uint16_t addr, uint8_t data)
         io_dma_transer(mem, data);
     } else if (port == IO_PORT_VBK) {
         data &= 0x01;
+        IO_PORT_WRITE(mem, port, data);
+        remap_memory_map(mem, VRAM_ID);
     } else if (port == IO_PORT_HDMA5) {
         data = hdma_transer(mem, data);
+    } else if (port == IO_PORT_SVBK) {
+        IO_PORT_WRITE(mem, port, data);
+        remap_memory_map(mem, WRAM_BANK_N_ID);
+        remap_memory_map(mem, WRAM_ECHO_ID);
     }
 
     IO_PORT_WRITE(mem, port, data);
@@ -269,17 +472,10 @@ static uint8_t
 bank_n_write(void *udata, uint16_t addr, uint8_t data)
 {
     gbc_memory_t *mem = (gbc_memory_t*)udata;
-    uint8_t bank = IO_PORT_READ(mem, IO_PORT_SVBK) & 0x7;
-    if (bank == 0) {
-        /* a value of 00h will select Bank 1 either. */
-        bank = 1;
-    }
-
-    LOG_DEBUG("[MEM] Writing to switchable RAM bank [%x] at address %x [%x]\n", bank, addr, data);
 
-    uint16_t bank_base = (bank * WRAM_BANK_SIZE);
-    mem->wram[addr - WRAM_BANK_N_BEGIN + bank_base] = data;
+    LOG_DEBUG("[MEM] Writing to switchable RAM bank at address %x [%x]\n", addr, data);
 
+    wram_bank_n(mem)[addr - WRAM_BANK_N_BEGIN] = data;
     return data;
 }
 
@@ -287,15 +483,10 @@ static uint8_t
 bank_n_read(void *udata, uint16_t addr)
 {
     gbc_memory_t *mem = (gbc_memory_t*)udata;
-    uint8_t bank = IO_PORT_READ(mem, IO_PORT_SVBK) & 0x7;
-    if (bank == 0) {
-        /* a value of 00h will select Bank 1 either. */
-        bank = 1;
-    }
-    LOG_DEBUG("[MEM] Reading from switchable RAM bank [%x] at address %x\n", bank, addr);
 
-    uint16_t bank_base = (bank * WRAM_BANK_SIZE);
-    return mem->wram[addr - WRAM_BANK_N_BEGIN + bank_base];
+    LOG_DEBUG("[MEM] Reading from switchable RAM bank at address %x\n", addr);
+
+    return wram_bank_n(mem)[addr - WRAM_BANK_N_BEGIN];
 }
 
 static uint8_t
@@ -339,6 +530,7 @@ gbc_mem_init(gbc_memory_t *mem)
     entry.addr_end = WRAM_BANK_0_END;
     entry.read = mem_raw_read;
     entry.write = mem_raw_write;
+    entry.remap = wram_bank_0_remap;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -349,6 +541,7 @@ gbc_mem_init(gbc_memory_t *mem)
     entry.addr_end = WRAM_BANK_N_END;
     entry.read = bank_n_read;
     entry.write = bank_n_write;
+    entry.remap = wram_bank_n_remap;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -359,6 +552,7 @@ gbc_mem_init(gbc_memory_t *mem)
     entry.addr_end = HRAM_END;
     entry.read = mem_raw_read;
     entry.write = mem_raw_write;
+    entry.remap = NULL;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -369,6 +563,7 @@ gbc_mem_init(gbc_memory_t *mem)
     entry.addr_end = IO_PORT_END;
     entry.read = io_port_read;
     entry.write = io_port_write;
+    entry.remap = NULL;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -379,6 +574,7 @@ gbc_mem_init(gbc_memory_t *mem)
     entry.addr_end = IO_PORT_END_2;
     entry.read = io_port_read;
     entry.write = io_port_write;
+    entry.remap = NULL;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -389,6 +585,7 @@ gbc_mem_init(gbc_memory_t *mem)
     entry.addr_end = IO_NOT_USABLE_END;
     entry.read = not_usable_read;
     entry.write = not_usable_write;
+    entry.remap = NULL;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -400,6 +597,7 @@ gbc_mem_init(gbc_memory_t *mem)
 
     entry.read = mem_echo_read;
     entry.write = mem_echo_write;
+    entry.remap = mem_echo_remap;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -410,6 +608,7 @@ gbc_mem_init(gbc_memory_t *mem)
     entry.addr_end = OAM_END;
     entry.read = oam_read;
     entry.write = oam_write;
+    entry.remap = NULL;
     entry.udata = mem;
 
     register_memory_map(mem, &entry);
@@ -423,6 +622,8 @@ gbc_mem_init(gbc_memory_t *mem)
     IO_PORT_WRITE(mem, IO_PORT_VBK, 0xFE);
     IO_PORT_WRITE(mem, IO_PORT_RP, 0x3E);
     IO_PORT_WRITE(mem, IO_PORT_SVBK, 0xF8);
+    remap_memory_map(mem, WRAM_BANK_N_ID);
+    remap_memory_map(mem, WRAM_ECHO_ID);
 
     /* This one is crucial, otherwise games like Tetris_dx will stuck at the title screen forever, cost me almost two days to identify this */
     IO_PORT_WRITE(mem, IO_PORT_P1, 0xCF);
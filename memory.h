@@ -64,6 +64,15 @@
 
 #define MEMORY_MAP_ENTRIES 14
 
+/* the bus is split into 256-byte pages, every page has its own dispatch entry */
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_MASK (MEMORY_PAGE_SIZE - 1)
+#define MEMORY_PAGES     (0x10000 >> MEMORY_PAGE_SHIFT)
+/* OAM, the unusable area, IO ports, HRAM and IE share the last two pages, they are dispatched per address */
+#define MEMORY_SHARED_BEGIN OAM_BEGIN
+#define MEMORY_SHARED_SIZE  (0x10000 - MEMORY_SHARED_BEGIN)
+
 #define RAM_ADDR_MASK 0x1fff   /* 13-bits 8KB */
 #define RAM_ADDR_MASK_SHIFT 13
 
@@ -132,6 +141,11 @@
 #define IO_PORT_PCM12 0x76
 #define IO_PORT_PCM34 0x77
 
+/* the registers a CGB has and a DMG does not, they read 0xff in DMG mode */
+#define IO_PORT_CGB_ONLY(port) ((port) == IO_PORT_KEY1 || (port) == IO_PORT_VBK || \
+    IN_RANGE((port), IO_PORT_HDMA1, IO_PORT_RP) || IN_RANGE((port), IO_PORT_BCPS_BCPI, IO_PORT_OPRI) || \
+    (port) == IO_PORT_SVBK)
+
 #define IO_ADDR_PORT(addr) ((addr) - IO_PORT_BASE)
 #define IO_PORT_ADDR(port) ((port) + IO_PORT_BASE)
 
@@ -144,14 +158,18 @@
 #define OBJ_PALETTE_READ(mem, idx) ((mem)->obj_palette + ((idx)))
 
 #define OAM_ADDR(mem) ((mem)->oam)
-#define GBC_BOOT_ROM_SIZE 0x8ff /* it is 2KB plus the hole in the middle */
+#define GBC_BOOT_ROM_SIZE 0x900 /* it is 2KB plus the hole in the middle */
 
 typedef struct gbc_memory gbc_memory_t;
 typedef struct memory_map_entry memory_map_entry_t;
 typedef struct gbc_palette gbc_palette_t;
+typedef struct memory_page memory_page_t;
 
 typedef uint8_t (*memory_read)(void *udata, uint16_t addr);
 typedef uint8_t (*memory_write)(void *udata, uint16_t addr, uint8_t data);
+typedef void (*memory_remap)(void *udata);
+typedef void (*memory_sync)(void *udata, uint8_t write);
+typedef void (*memory_invalidate)(void *udata, uint8_t *host);
 
 struct memory_map_entry
 {
@@ -160,9 +178,20 @@ struct memory_map_entry
     uint16_t addr_end;
     memory_read read;
     memory_write write;
+    /* optional, (re)installs direct host pointers for the pages of this entry, see map_memory_pages */
+    memory_remap remap;
     void *udata;
 };
 
+struct memory_page
+{
+    /* host memory backing this page, NULL means the access goes through the entry handler */
+    uint8_t *read;
+    uint8_t *write;
+    /* NULL if the page is shared by more than one entry (e.g. OAM and IO ports), see shared_entries */
+    memory_map_entry_t *entry;
+};
+
 struct gbc_palette
 {
     uint16_t c[4]; /* 4 colors x 2 bytes per color */
@@ -174,6 +203,17 @@ struct gbc_memory
     memory_read read;
     memory_write write;
     memory_map_entry_t map[MEMORY_MAP_ENTRIES];
+    memory_page_t pages[MEMORY_PAGES];
+    /* entry of every address from MEMORY_SHARED_BEGIN up, NULL where nothing is mapped */
+    memory_map_entry_t *shared_entries[MEMORY_SHARED_SIZE];
+    /* optional, called before accessing anything the other components can observe (VRAM writes, OAM, IO) */
+    memory_sync sync;
+    void *sync_udata;
+    /* optional, called with the page when a WRAM page holding cached code is written */
+    memory_invalidate invalidate;
+    void *invalidate_udata;
+    uint32_t map_generation;    /* bumped whenever a page is remapped */
+    uint8_t wram_code[(WRAM_BANK_SIZE * WRAM_BANKS) >> MEMORY_PAGE_SHIFT];
     uint8_t wram[WRAM_BANK_SIZE * WRAM_BANKS];
     uint8_t hraw[HRAM_END - HRAM_BEGIN + 1];
     /* I moved audio registers to the audio module
@@ -187,10 +227,16 @@ struct gbc_memory
 
     uint8_t boot_rom_enabled;
     uint8_t boot_rom[GBC_BOOT_ROM_SIZE];
+    /* a DMG cartridge, there is no VRAM bank 1, no WRAM banking, no CGB palettes or registers */
+    uint8_t dmg;
 };
 
 void gbc_mem_init(gbc_memory_t *mem);
 void register_memory_map(gbc_memory_t *mem, memory_map_entry_t *entry);
+void remap_memory_map(gbc_memory_t *mem, uint16_t id);
+void remap_memory(gbc_memory_t *mem);
+void map_memory_pages(gbc_memory_t *mem, uint16_t begin, uint16_t end, uint8_t *read, uint8_t *write);
+void protect_wram_code(gbc_memory_t *mem, const uint8_t *host);
 void* connect_io_port(gbc_memory_t *mem, uint16_t addr);
 
 #endif
@@ -0,0 +1,330 @@
+#include "rewind.h"
+#include "state.h"
+
+/*
+  A snapshot is encoded against a reference of the same size (its keyframe, or
+  zeros for the keyframes themselves) as tokens of
+    varint unchanged bytes, varint changed bytes, the changed bytes
+  the unchanged bytes at the end need no token.
+*/
+
+#define REWIND_SEQ_NONE UINT64_MAX
+
+static inline uint64_t
+load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t
+load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static size_t
+put_varint(uint8_t *out, uint64_t v)
+{
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+static int
+get_varint(const uint8_t *in, size_t size, size_t *pos, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; *pos < size && shift < 64; shift += 7) {
+        uint8_t b = in[(*pos)++];
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return 0;
+    }
+    return 1;
+}
+
+static size_t
+rewind_encode(const uint8_t *cur, const uint8_t *ref, size_t n, uint8_t *out)
+{
+    size_t pos = 0, i = 0;
+
+    while (i < n) {
+        size_t start = i;
+        while (i + 8 <= n && load64(cur + i) == load64(ref + i))
+            i += 8;
+        while (i < n && cur[i] == ref[i])
+            i++;
+        if (i == n)
+            break;
+
+        size_t same = i - start;
+        start = i;
+        /* a short unchanged gap is cheaper to copy than to start a new token */
+        while (i < n && (i + 4 <= n ? load32(cur + i) != load32(ref + i) : cur[i] != ref[i]))
+            i++;
+
+        pos += put_varint(out + pos, same);
+        pos += put_varint(out + pos, i - start);
+        memcpy(out + pos, cur + start, i - start);
+        pos += i - start;
+    }
+
+    return pos;
+}
+
+static int
+rewind_decode(const uint8_t *in, size_t size, const uint8_t *ref, uint8_t *out, size_t n)
+{
+    size_t pos = 0, o = 0;
+
+    memcpy(out, ref, n);
+    while (pos < size) {
+        uint64_t same, changed;
+        if (get_varint(in, size, &pos, &same) || get_varint(in, size, &pos, &changed))
+            return 1;
+        if (same > n - o || changed > n - o - same || changed > size - pos)
+            return 1;
+
+        o += same;
+        memcpy(out + o, in + pos, changed);
+        o += changed;
+        pos += changed;
+    }
+
+    return 0;
+}
+
+static inline gbc_rewind_entry_t*
+rewind_entry(gbc_rewind_t *rewind, uint64_t seq)
+{
+    uint64_t oldest = rewind->next_seq - rewind->count;
+    return &rewind->entries[(rewind->first + (seq - oldest)) % rewind->max_entries];
+}
+
+static inline uint8_t
+rewind_has(gbc_rewind_t *rewind, uint64_t seq)
+{
+    return rewind->count && seq >= rewind->next_seq - rewind->count && seq < rewind->next_seq;
+}
+
+static void
+rewind_evict(gbc_rewind_t *rewind)
+{
+    /* the deltas are useless without their keyframe */
+    do {
+        rewind->used -= rewind->entries[rewind->first].size;
+        rewind->first = (rewind->first + 1) % rewind->max_entries;
+        rewind->count--;
+    } while (rewind->count && rewind->entries[rewind->first].keyframe != rewind->next_seq - rewind->count);
+
+    if (!rewind->count)
+        rewind->head = 0;
+}
+
+/* makes room for n bytes, returns where they go or SIZE_MAX if they never fit */
+static size_t
+rewind_reserve(gbc_rewind_t *rewind, size_t n)
+{
+    if (n > rewind->ring_size)
+        return SIZE_MAX;
+
+    if (rewind->count == rewind->max_entries)
+        rewind_evict(rewind);
+
+    size_t p = rewind->head;
+    if (p + n > rewind->ring_size) {
+        /* the space left at the end is skipped, whatever still lives there is the oldest */
+        while (rewind->count && rewind->entries[rewind->first].offset >= rewind->head)
+            rewind_evict(rewind);
+        p = 0;
+    }
+
+    while (rewind->count) {
+        gbc_rewind_entry_t *oldest = &rewind->entries[rewind->first];
+        if (oldest->offset >= p + n || oldest->offset + oldest->size <= p)
+            break;
+        rewind_evict(rewind);
+    }
+
+    return p;
+}
+
+/* makes rewind->keyframe hold the keyframe seq */
+static int
+rewind_load_keyframe(gbc_rewind_t *rewind, uint64_t seq)
+{
+    if (rewind->keyframe_seq == seq)
+        return 0;
+
+    gbc_rewind_entry_t *entry = rewind_entry(rewind, seq);
+    rewind->keyframe_seq = REWIND_SEQ_NONE;
+    if (rewind_decode(rewind->ring + entry->offset, entry->size, rewind->zero, rewind->keyframe, rewind->state_size))
+        return 1;
+
+    rewind->keyframe_seq = seq;
+    return 0;
+}
+
+gbc_rewind_t*
+gbc_rewind_create(gbc_t *gbc, size_t ring_size, uint32_t interval)
+{
+    gbc_rewind_t *rewind = (gbc_rewind_t*)malloc_memory(sizeof(gbc_rewind_t));
+    if (!rewind) {
+        LOG_ERROR("[REWIND] Failed to allocate memory\n");
+        return NULL;
+    }
+    memset(rewind, 0, sizeof(gbc_rewind_t));
+
+    rewind->ring_size = ring_size;
+    rewind->state_size = gbc_state_size(gbc);
+    /* a delta of an idle frame is a few bytes, this is minutes of history */
+    rewind->max_entries = ring_size / 1024 > 16 ? ring_size / 1024 : 16;
+    rewind->interval = interval ? interval : 1;
+    rewind->keyframe_seq = REWIND_SEQ_NONE;
+
+    rewind->ring = (uint8_t*)malloc_memory(ring_size);
+    rewind->entries = (gbc_rewind_entry_t*)malloc_memory(rewind->max_entries * sizeof(gbc_rewind_entry_t));
+    rewind->state = (uint8_t*)malloc_memory(rewind->state_size);
+    rewind->keyframe = (uint8_t*)malloc_memory(rewind->state_size);
+    rewind->zero = (uint8_t*)malloc_memory(rewind->state_size);
+    /* worst case is a token for every 5 bytes */
+    rewind->encoded = (uint8_t*)malloc_memory(rewind->state_size * 3 + 64);
+
+    if (!rewind->ring || !rewind->entries || !rewind->state || !rewind->keyframe ||
+        !rewind->zero || !rewind->encoded) {
+        LOG_ERROR("[REWIND] Failed to allocate memory\n");
+        gbc_rewind_destroy(rewind);
+        return NULL;
+    }
+
+    memset(rewind->state, 0, rewind->state_size);
+    memset(rewind->zero, 0, rewind->state_size);
+    return rewind;
+}
+
+void
+gbc_rewind_destroy(gbc_rewind_t *rewind)
+{
+    if (!rewind)
+        return;
+
+    free_memory(rewind->ring);
+    free_memory(rewind->entries);
+    free_memory(rewind->state);
+    free_memory(rewind->keyframe);
+    free_memory(rewind->zero);
+    free_memory(rewind->encoded);
+    free_memory(rewind);
+}
+
+void
+gbc_rewind_push(gbc_rewind_t *rewind, gbc_t *gbc)
+{
+    if (rewind->countdown) {
+        rewind->countdown--;
+        return;
+    }
+    rewind->countdown = rewind->interval - 1;
+
+    if (!gbc_state_save(gbc, rewind->state, rewind->state_size))
+        return;
+
+    uint64_t seq = rewind->next_seq;
+    uint64_t keyframe = rewind->count ? rewind_entry(rewind, seq - 1)->keyframe : REWIND_SEQ_NONE;
+
+    if (keyframe != REWIND_SEQ_NONE &&
+        (seq - keyframe >= GBC_REWIND_KEYFRAME_INTERVAL || rewind_load_keyframe(rewind, keyframe)))
+        keyframe = REWIND_SEQ_NONE;
+
+    size_t n, offset;
+    for (;;) {
+        const uint8_t *ref = keyframe == REWIND_SEQ_NONE ? rewind->zero : rewind->keyframe;
+        n = rewind_encode(rewind->state, ref, rewind->state_size, rewind->encoded);
+        offset = rewind_reserve(rewind, n);
+        if (offset == SIZE_MAX)
+            return;
+        /* making room dropped its own keyframe */
+        if (keyframe != REWIND_SEQ_NONE && !rewind_has(rewind, keyframe)) {
+            keyframe = REWIND_SEQ_NONE;
+            continue;
+        }
+        break;
+    }
+
+    memcpy(rewind->ring + offset, rewind->encoded, n);
+
+    gbc_rewind_entry_t *entry = &rewind->entries[(rewind->first + rewind->count) % rewind->max_entries];
+    entry->offset = offset;
+    entry->size = n;
+    entry->keyframe = keyframe == REWIND_SEQ_NONE ? seq : keyframe;
+
+    rewind->count++;
+    rewind->next_seq++;
+    rewind->head = offset + n;
+    rewind->used += n;
+
+    if (keyframe == REWIND_SEQ_NONE) {
+        memcpy(rewind->keyframe, rewind->state, rewind->state_size);
+        rewind->keyframe_seq = seq;
+    }
+}
+
+int
+gbc_rewind_pop(gbc_rewind_t *rewind, gbc_t *gbc)
+{
+    if (!rewind->count)
+        return 1;
+
+    uint64_t seq = rewind->next_seq - 1;
+    gbc_rewind_entry_t *entry = rewind_entry(rewind, seq);
+    int ret;
+
+    if (entry->keyframe == seq) {
+        ret = rewind_decode(rewind->ring + entry->offset, entry->size, rewind->zero, rewind->state, rewind->state_size);
+    } else {
+        ret = rewind_load_keyframe(rewind, entry->keyframe) ||
+            rewind_decode(rewind->ring + entry->offset, entry->size, rewind->keyframe, rewind->state, rewind->state_size);
+    }
+
+    /* the sequence number is reused by the next push */
+    rewind->count--;
+    rewind->next_seq--;
+    rewind->used -= entry->size;
+    if (rewind->keyframe_seq == seq)
+        rewind->keyframe_seq = REWIND_SEQ_NONE;
+    if (rewind->count) {
+        gbc_rewind_entry_t *newest = rewind_entry(rewind, seq - 1);
+        rewind->head = newest->offset + newest->size;
+    } else {
+        rewind->head = 0;
+    }
+    /* snapshot the frame right after rewinding stops */
+    rewind->countdown = 0;
+
+    if (ret) {
+        LOG_ERROR("[REWIND] Corrupted snapshot\n");
+        return 1;
+    }
+
+    return gbc_state_load(gbc, rewind->state, rewind->state_size) ? 1 : 0;
+}
+
+uint64_t
+gbc_rewind_frames(gbc_rewind_t *rewind)
+{
+    return (uint64_t)rewind->count * rewind->interval;
+}
+
+size_t
+gbc_rewind_used(gbc_rewind_t *rewind)
+{
+    return rewind->used;
+}
@@ -0,0 +1,70 @@
+#ifndef _REWIND_H
+#define _REWIND_H
+
+#include "gbc.h"
+
+/*
+  Rewind history.
+  Every interval frames the whole machine is saved (see state.h) into a fixed
+  size byte ring. Most of a state does not change from frame to frame, so only
+  the first snapshot of every GBC_REWIND_KEYFRAME_INTERVAL is a keyframe, the
+  others only keep the bytes that differ from their keyframe, run length
+  encoded. The oldest keyframe and its deltas are dropped together when the
+  ring is full.
+
+  gbc_frame pushes a snapshot before every frame, while gbc->rewinding is set it
+  pops the newest one instead and runs that frame again, so with an interval of
+  1 every frame goes back exactly one frame.
+*/
+
+#define GBC_REWIND_KEYFRAME_INTERVAL    60
+#define GBC_REWIND_DEFAULT_SIZE         (32 * 1024 * 1024)      /* more than a minute of history */
+
+typedef struct gbc_rewind_entry gbc_rewind_entry_t;
+
+struct gbc_rewind_entry
+{
+    size_t offset;              /* in the ring */
+    uint32_t size;
+    uint64_t keyframe;          /* sequence number of the keyframe it is relative to, itself for keyframes */
+};
+
+struct gbc_rewind
+{
+    uint8_t *ring;
+    size_t ring_size;
+    size_t head;                /* where the newest entry ends */
+    size_t used;
+
+    /* entries[first] is the oldest, sequence numbers are contiguous */
+    gbc_rewind_entry_t *entries;
+    uint32_t max_entries;
+    uint32_t first;
+    uint32_t count;
+    uint64_t next_seq;
+
+    size_t state_size;
+    uint8_t *state;             /* the snapshot being pushed or popped */
+    uint8_t *keyframe;          /* the decoded keyframe_seq */
+    uint8_t *zero;              /* keyframes are encoded against it */
+    uint8_t *encoded;
+    uint64_t keyframe_seq;
+
+    uint32_t interval;
+    uint32_t countdown;
+};
+
+/* ring_size bytes of history, a snapshot every interval frames */
+gbc_rewind_t* gbc_rewind_create(gbc_t *gbc, size_t ring_size, uint32_t interval);
+void gbc_rewind_destroy(gbc_rewind_t *rewind);
+
+/* called before every frame, takes a snapshot when it is due */
+void gbc_rewind_push(gbc_rewind_t *rewind, gbc_t *gbc);
+/* loads the newest snapshot and drops it, returns 1 if there is none left */
+int gbc_rewind_pop(gbc_rewind_t *rewind, gbc_t *gbc);
+/* frames of history */
+uint64_t gbc_rewind_frames(gbc_rewind_t *rewind);
+/* bytes of the ring in use */
+size_t gbc_rewind_used(gbc_rewind_t *rewind);
+
+#endif
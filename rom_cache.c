@@ -0,0 +1,169 @@
+#include "rom_cache.h"
+
+/* guards _roms and the refs of its images */
+static gbc_rom_t *_roms;
+static gbc_mutex_t _roms_lock = GBC_MUTEX_INITIALIZER;
+
+static uint64_t
+rom_hash(const mapped_file_t *file)
+{
+    /*
+      FNV-1a over 64 bit words, with the high bits folded back after every
+      multiply, a plain multiply never moves a difference down so flips of
+      bit 63 in two words would cancel. Only a pre-filter, see gbc_rom_acquire.
+    */
+    uint64_t h = 14695981039346656037ULL;
+    size_t i = 0;
+
+    for (; i + 8 <= file->size; i += 8) {
+        uint64_t word;
+        memcpy(&word, file->data + i, 8);
+        h = (h ^ word) * 1099511628211ULL;
+        h ^= h >> 29;
+    }
+    for (; i < file->size; i++)
+        h = (h ^ file->data[i]) * 1099511628211ULL;
+
+    return h;
+}
+
+static uint64_t
+rom_get_hash(gbc_rom_t *rom)
+{
+    if (!rom->hashed) {
+        rom->hash = rom_hash(&rom->file);
+        rom->hashed = 1;
+    }
+    return rom->hash;
+}
+
+/* header checks before anything looks at the banks */
+static int
+rom_map(mapped_file_t *file, const char *path)
+{
+    if (map_file(file, path) != 0) {
+        LOG_ERROR("Failed to open cartridge\n");
+        return 1;
+    }
+
+    if (file->size < CARTRIDGE_HEADER_END) {
+        LOG_ERROR("Cartridge is too small (%zu bytes)\n", file->size);
+        unmap_file(file);
+        return 1;
+    }
+
+    uint8_t rom_size = ((cartridge_t*)file->data)->rom_size;
+    if (rom_size > CARTRIDGE_MAX_ROM_SIZE) {
+        LOG_ERROR("Invalid ROM size $%x\n", rom_size);
+        unmap_file(file);
+        return 1;
+    }
+
+    size_t size = cartridge_rom_size((cartridge_t*)file->data);
+    if (file->size < size) {
+        /* a trimmed dump, the banks must not point past the end of the mapping */
+        LOG_INFO("Cartridge is %zu bytes but its header says %zu, padding it\n", file->size, size);
+        uint8_t *data = (uint8_t*)malloc_memory(size);
+        if (!data) {
+            LOG_ERROR("Failed to allocate memory\n");
+            unmap_file(file);
+            return 1;
+        }
+        memcpy(data, file->data, file->size);
+        memset(data + file->size, 0xff, size - file->size);
+        unmap_file(file);
+        file->data = data;
+        file->size = size;
+        file->mapped = 0;
+    }
+
+    return 0;
+}
+
+static uint8_t
+rom_same_header(const mapped_file_t *a, const mapped_file_t *b)
+{
+    /* header checksum (0x14d) and global checksum (0x14e - 0x14f) */
+    return a->size == b->size && memcmp(a->data + 0x14d, b->data + 0x14d, 3) == 0;
+}
+
+gbc_rom_t*
+gbc_rom_acquire(const char *path)
+{
+    mapped_file_t file;
+    if (rom_map(&file, path) != 0)
+        return NULL;
+
+    uint8_t hashed = 0;
+    uint64_t hash = 0;
+
+    lock_mutex(&_roms_lock);
+    for (gbc_rom_t *rom = _roms; rom; rom = rom->next) {
+        if (!rom_same_header(&rom->file, &file))
+            continue;
+
+        if (!hashed) {
+            hash = rom_hash(&file);
+            hashed = 1;
+        }
+
+        /* the same hash is not the same image */
+        if (rom_get_hash(rom) == hash && memcmp(rom->file.data, file.data, file.size) == 0) {
+            rom->refs++;
+            unlock_mutex(&_roms_lock);
+            unmap_file(&file);
+            return rom;
+        }
+    }
+
+    gbc_rom_t *rom = (gbc_rom_t*)malloc_memory(sizeof(gbc_rom_t));
+    if (!rom) {
+        unlock_mutex(&_roms_lock);
+        LOG_ERROR("Failed to allocate memory\n");
+        unmap_file(&file);
+        return NULL;
+    }
+
+    rom->file = file;
+    rom->hash = hash;
+    rom->hashed = hashed;
+    rom->refs = 1;
+
+    rom->cart = cartridge_load(rom->file.data);
+    if (!rom->cart) {
+        unlock_mutex(&_roms_lock);
+        LOG_ERROR("Failed to load cartridge\n");
+        unmap_file(&rom->file);
+        free_memory(rom);
+        return NULL;
+    }
+
+    rom->next = _roms;
+    _roms = rom;
+    unlock_mutex(&_roms_lock);
+    return rom;
+}
+
+void
+gbc_rom_release(gbc_rom_t *rom)
+{
+    if (!rom)
+        return;
+
+    lock_mutex(&_roms_lock);
+    if (--rom->refs) {
+        unlock_mutex(&_roms_lock);
+        return;
+    }
+
+    for (gbc_rom_t **p = &_roms; *p; p = &(*p)->next) {
+        if (*p == rom) {
+            *p = rom->next;
+            break;
+        }
+    }
+    unlock_mutex(&_roms_lock);
+
+    unmap_file(&rom->file);
+    free_memory(rom);
+}
@@ -0,0 +1,34 @@
+#ifndef _ROM_CACHE_H
+#define _ROM_CACHE_H
+
+#include "common.h"
+#include "cartridge.h"
+
+typedef struct gbc_rom gbc_rom_t;
+
+/*
+  Cartridge images shared by every gbc_t of the process.
+  An image is immutable once loaded, gbc_rom_acquire returns the already loaded
+  one when the file has the same contents (same size and header checksums, a
+  hash of the whole image, then a full compare), so dozens of instances of a
+  game hold a single mapping and a single parsed header.
+
+  Acquire and release lock the registry, so instances can be created and
+  destroyed from any thread (one thread only with GBC_NO_THREADS), the images
+  themselves are read without a lock.
+*/
+struct gbc_rom
+{
+    mapped_file_t file;
+    cartridge_t *cart;          /* points into the image */
+    uint64_t hash;              /* computed on the first lookup that needs it */
+    uint8_t hashed;
+    uint32_t refs;
+    gbc_rom_t *next;
+};
+
+/* loads the cartridge file or takes another reference to an identical image, NULL on failure */
+gbc_rom_t* gbc_rom_acquire(const char *path);
+void gbc_rom_release(gbc_rom_t *rom);
+
+#endif
@@ -0,0 +1,51 @@
+#include "scheduler.h"
+
+void
+gbc_scheduler_init(gbc_scheduler_t *sched)
+{
+    memset(sched, 0, sizeof(gbc_scheduler_t));
+}
+
+void
+gbc_scheduler_remove(gbc_scheduler_t *sched, uint8_t id)
+{
+    for (int i = 0; i < sched->count; i++) {
+        if (sched->events[i].id == id) {
+            memmove(&sched->events[i], &sched->events[i+1], (sched->count - i - 1) * sizeof(gbc_event_t));
+            sched->count--;
+            return;
+        }
+    }
+}
+
+/* an event with the same id is replaced */
+void
+gbc_scheduler_add(gbc_scheduler_t *sched, uint8_t id, uint64_t when)
+{
+    gbc_scheduler_remove(sched, id);
+
+    if (sched->count == SCHEDULER_MAX_EVENTS) {
+        LOG_ERROR("[SCHED] Too many events\n");
+        abort();
+    }
+
+    /* there are only a handful of events, insertion sort is good enough */
+    int i = sched->count;
+    while (i > 0 && sched->events[i-1].when > when) {
+        sched->events[i] = sched->events[i-1];
+        i--;
+    }
+
+    sched->events[i].when = when;
+    sched->events[i].id = id;
+    sched->count++;
+}
+
+/* must be called when the components are synced, the clocks after this point run at the new speed */
+void
+gbc_scheduler_set_speed(gbc_scheduler_t *sched, uint8_t dspeed)
+{
+    sched->base_cycles = sched->cycles;
+    sched->base_clocks = sched->clocks;
+    sched->dspeed = dspeed;
+}
@@ -0,0 +1,63 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "common.h"
+
+#define SCHEDULER_MAX_EVENTS 8
+#define SCHEDULER_NEVER UINT64_MAX
+
+/* event ids */
+#define EVENT_FRAME 1           /* end of the logic frame */
+#define EVENT_PPU   2           /* next ppu mode transition */
+#define EVENT_TIMER 3           /* next TIMA overflow */
+
+typedef struct gbc_scheduler gbc_scheduler_t;
+typedef struct gbc_event gbc_event_t;
+
+struct gbc_event
+{
+    uint64_t when;              /* cpu cycle */
+    uint8_t id;
+};
+
+/*
+  The cpu runs whole instructions ahead, the other components are only
+  brought up to date (synced) when the cpu reaches a deadline or touches
+  something they can observe.
+
+  cycles: cpu cycles, the timer ticks once per cycle.
+  clocks: the 4MHz base clock the ppu, io and audio run at, it equals cycles
+  in normal speed and half of them in double speed.
+*/
+struct gbc_scheduler
+{
+    /* a tiny sorted queue, events[0] is always the earliest one */
+    gbc_event_t events[SCHEDULER_MAX_EVENTS];
+    uint8_t count;
+
+    uint64_t cycles;            /* cpu cycles the components have been synced to */
+    uint64_t clocks;            /* clocks the components have been synced to */
+    uint64_t base_cycles;       /* clocks = base_clocks + ((cycles - base_cycles) >> dspeed) */
+    uint64_t base_clocks;
+    uint64_t frame_end;         /* in clocks */
+    uint8_t dspeed:1;
+    uint8_t dirty:1;            /* the cpu wrote something the deadlines depend on */
+    uint8_t lockstep:1;         /* components are ticked along with the cpu, syncing is not needed */
+};
+
+void gbc_scheduler_init(gbc_scheduler_t *sched);
+void gbc_scheduler_add(gbc_scheduler_t *sched, uint8_t id, uint64_t when);
+void gbc_scheduler_remove(gbc_scheduler_t *sched, uint8_t id);
+void gbc_scheduler_set_speed(gbc_scheduler_t *sched, uint8_t dspeed);
+
+#define gbc_scheduler_next(sched) ((sched)->count ? (sched)->events[0].when : SCHEDULER_NEVER)
+
+/* clocks elapsed once the cpu has run the given cycles */
+#define gbc_scheduler_clocks_at(sched, c) \
+    ((sched)->base_clocks + (((c) - (sched)->base_cycles) >> (sched)->dspeed))
+
+/* cpu cycles it takes to reach the given clock */
+#define gbc_scheduler_cycles_at(sched, c) \
+    ((sched)->base_cycles + (((c) - (sched)->base_clocks) << (sched)->dspeed))
+
+#endif
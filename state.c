@@ -0,0 +1,611 @@
+#include "state.h"
+#include "block_cache.h"
+
+typedef struct state_writer state_writer_t;
+typedef struct state_reader state_reader_t;
+
+/* a writer without data only counts the bytes */
+struct state_writer
+{
+    uint8_t *data;
+    size_t size;
+    size_t pos;
+};
+
+struct state_reader
+{
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+};
+
+/* cartridge header bytes a state is tied to: title, header and global checksum */
+#define STATE_CART_ID_SIZE 19
+
+#define STATE_TAG_CPU   "CPU "
+#define STATE_TAG_MEM   "MEM "
+#define STATE_TAG_PPU   "PPU "
+#define STATE_TAG_TIMER "TIMR"
+#define STATE_TAG_APU   "APU "
+#define STATE_TAG_MBC   "MBC "
+#define STATE_TAG_SCHED "SCHD"
+
+#define STATE_SECTION_HEADER_SIZE 8     /* tag + length */
+
+static void
+put_bytes(state_writer_t *w, const void *src, size_t n)
+{
+    if (w->data && w->pos + n <= w->size)
+        memcpy(w->data + w->pos, src, n);
+    w->pos += n;
+}
+
+static void
+put_u8(state_writer_t *w, uint8_t v)
+{
+    put_bytes(w, &v, 1);
+}
+
+static void
+put_u16(state_writer_t *w, uint16_t v)
+{
+    uint8_t b[2] = { v & 0xff, v >> 8 };
+    put_bytes(w, b, 2);
+}
+
+static void
+put_u32(state_writer_t *w, uint32_t v)
+{
+    put_u16(w, v & 0xffff);
+    put_u16(w, v >> 16);
+}
+
+static void
+put_u64(state_writer_t *w, uint64_t v)
+{
+    put_u32(w, v & 0xffffffff);
+    put_u32(w, v >> 32);
+}
+
+static void
+get_bytes(state_reader_t *r, void *dst, size_t n)
+{
+    /* the sections are validated before anything is read, this is just in case */
+    if (r->pos + n > r->size) {
+        memset(dst, 0, n);
+        r->pos = r->size;
+        return;
+    }
+    memcpy(dst, r->data + r->pos, n);
+    r->pos += n;
+}
+
+static uint8_t
+get_u8(state_reader_t *r)
+{
+    uint8_t v;
+    get_bytes(r, &v, 1);
+    return v;
+}
+
+static uint16_t
+get_u16(state_reader_t *r)
+{
+    uint8_t b[2];
+    get_bytes(r, b, 2);
+    return b[0] | (b[1] << 8);
+}
+
+static uint32_t
+get_u32(state_reader_t *r)
+{
+    uint32_t lo = get_u16(r);
+    return lo | ((uint32_t)get_u16(r) << 16);
+}
+
+static uint64_t
+get_u64(state_reader_t *r)
+{
+    uint64_t lo = get_u32(r);
+    return lo | ((uint64_t)get_u32(r) << 32);
+}
+
+static void
+cart_id(gbc_t *gbc, uint8_t id[STATE_CART_ID_SIZE])
+{
+    const uint8_t *header = (const uint8_t*)gbc->mbc.cart;
+    memcpy(id, header + 0x134, 16);         /* title */
+    memcpy(id + 16, header + 0x14d, 3);     /* header checksum, global checksum */
+}
+
+/* sections, the load functions must read exactly what the save functions write */
+
+static void
+save_cpu(state_writer_t *w, gbc_t *gbc)
+{
+    gbc_cpu_t *cpu = &gbc->cpu;
+
+    put_u16(w, cpu->regs.R_AF.AF);
+    put_u16(w, cpu->regs.R_BC.BC);
+    put_u16(w, cpu->regs.R_DE.DE);
+    put_u16(w, cpu->regs.R_HL.HL);
+    put_u16(w, cpu->regs.SP);
+    put_u16(w, cpu->regs.PC);
+    put_u64(w, cpu->cycles);
+    put_u16(w, cpu->ins_cycles);
+    put_u8(w, cpu->ime);
+    put_u8(w, cpu->ier);
+    put_u8(w, cpu->ime_insts);
+    put_u8(w, cpu->halt);
+    put_u8(w, cpu->dspeed);
+}
+
+static void
+load_cpu(state_reader_t *r, gbc_t *gbc)
+{
+    gbc_cpu_t *cpu = &gbc->cpu;
+
+    cpu->regs.R_AF.AF = get_u16(r);
+    cpu->regs.R_BC.BC = get_u16(r);
+    cpu->regs.R_DE.DE = get_u16(r);
+    cpu->regs.R_HL.HL = get_u16(r);
+    cpu->regs.SP = get_u16(r);
+    cpu->regs.PC = get_u16(r);
+    cpu->cycles = get_u64(r);
+    cpu->ins_cycles = get_u16(r);
+    cpu->ime = get_u8(r);
+    cpu->ier = get_u8(r);
+    cpu->ime_insts = get_u8(r);
+    cpu->halt = get_u8(r);
+    cpu->dspeed = get_u8(r);
+}
+
+static void
+save_mem(state_writer_t *w, gbc_t *gbc)
+{
+    gbc_memory_t *mem = &gbc->mem;
+
+    put_bytes(w, mem->wram, sizeof(mem->wram));
+    put_bytes(w, mem->hraw, sizeof(mem->hraw));
+    put_bytes(w, mem->io_ports, sizeof(mem->io_ports));
+    put_bytes(w, mem->oam, sizeof(mem->oam));
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            put_u16(w, mem->bg_palette[i].c[j]);
+            put_u16(w, mem->obj_palette[i].c[j]);
+        }
+    }
+    put_u8(w, mem->boot_rom_enabled);
+}
+
+static void
+load_mem(state_reader_t *r, gbc_t *gbc)
+{
+    gbc_memory_t *mem = &gbc->mem;
+
+    get_bytes(r, mem->wram, sizeof(mem->wram));
+    get_bytes(r, mem->hraw, sizeof(mem->hraw));
+    get_bytes(r, mem->io_ports, sizeof(mem->io_ports));
+    get_bytes(r, mem->oam, sizeof(mem->oam));
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) {
+            mem->bg_palette[i].c[j] = get_u16(r);
+            mem->obj_palette[i].c[j] = get_u16(r);
+        }
+    }
+    mem->boot_rom_enabled = get_u8(r);
+}
+
+static void
+save_ppu(state_writer_t *w, gbc_t *gbc)
+{
+    gbc_graphic_t *graphic = &gbc->graphic;
+
+    put_bytes(w, graphic->vram, sizeof(graphic->vram));
+    put_u32(w, graphic->dots);
+    put_u8(w, graphic->scanline);
+    put_u8(w, graphic->mode);
+}
+
+static void
+load_ppu(state_reader_t *r, gbc_t *gbc)
+{
+    gbc_graphic_t *graphic = &gbc->graphic;
+
+    get_bytes(r, graphic->vram, sizeof(graphic->vram));
+    graphic->dots = get_u32(r);
+    graphic->scanline = get_u8(r);
+    graphic->mode = get_u8(r);
+}
+
+static void
+save_timer(state_writer_t *w, gbc_t *gbc)
+{
+    put_u16(w, gbc->timer.div_cycles);
+    put_u16(w, gbc->timer.timer_cycles);
+}
+
+static void
+load_timer(state_reader_t *r, gbc_t *gbc)
+{
+    gbc->timer.div_cycles = get_u16(r);
+    gbc->timer.timer_cycles = get_u16(r);
+}
+
+static void
+save_channel(state_writer_t *w, gbc_audio_channel_t *c, uint8_t noise)
+{
+    put_u8(w, c->NRx0);
+    put_u8(w, c->NRx1);
+    put_u8(w, c->NRx2);
+    put_u8(w, c->NRx3);
+    put_u8(w, c->NRx4);
+    put_u32(w, c->sample_cycles);
+    /* the lfsr of channel 4 shares its bytes with the sweep of channel 1 */
+    if (noise) {
+        put_u16(w, c->lfsr);
+    } else {
+        put_u8(w, c->sweep_pace | (c->sweep_pace_enabled << 6) | (c->sweep_negate_obscure_bit << 7));
+        put_u8(w, c->sweep_pace_counter);
+    }
+    put_u16(w, c->sweep_shadow_period);
+    put_u16(w, c->length_counter);
+    put_u8(w, c->waveform_idx);
+    put_u8(w, c->volume);
+    put_u8(w, c->volume_pace);
+    put_u8(w, c->volume_pace_counter);
+    put_u8(w, c->volume_dir | (c->length_enabled << 1) | (c->frame_sequencer_flag << 2) | (c->on << 3));
+}
+
+static void
+load_channel(state_reader_t *r, gbc_audio_channel_t *c, uint8_t noise)
+{
+    c->NRx0 = get_u8(r);
+    c->NRx1 = get_u8(r);
+    c->NRx2 = get_u8(r);
+    c->NRx3 = get_u8(r);
+    c->NRx4 = get_u8(r);
+    c->sample_cycles = get_u32(r);
+    if (noise) {
+        c->lfsr = get_u16(r);
+    } else {
+        uint8_t sweep = get_u8(r);
+        c->sweep_pace = sweep & 0x3f;
+        c->sweep_pace_enabled = (sweep >> 6) & 1;
+        c->sweep_negate_obscure_bit = (sweep >> 7) & 1;
+        c->sweep_pace_counter = get_u8(r);
+    }
+    c->sweep_shadow_period = get_u16(r);
+    c->length_counter = get_u16(r);
+    c->waveform_idx = get_u8(r);
+    c->volume = get_u8(r);
+    c->volume_pace = get_u8(r);
+    c->volume_pace_counter = get_u8(r);
+    uint8_t flags = get_u8(r);
+    c->volume_dir = flags & 1;
+    c->length_enabled = (flags >> 1) & 1;
+    c->frame_sequencer_flag = (flags >> 2) & 1;
+    c->on = (flags >> 3) & 1;
+}
+
+static void
+save_apu(state_writer_t *w, gbc_t *gbc)
+{
+    gbc_audio_t *audio = &gbc->audio;
+
+    put_u64(w, audio->cycles);
+    save_channel(w, &audio->c1, 0);
+    save_channel(w, &audio->c2, 0);
+    save_channel(w, &audio->c3, 0);
+    save_channel(w, &audio->c4, 1);
+    put_u8(w, audio->NR52);
+    put_u8(w, audio->NR51);
+    put_u8(w, audio->NR50);
+    put_u32(w, audio->output_sample_cycles_remainder);
+    put_u16(w, audio->output_sample_cycles);
+    put_u16(w, audio->sample_divider);
+    put_u8(w, audio->m_cycles);
+    put_u8(w, audio->frame_sequencer);
+    put_u8(w, audio->frame_envelope_sweep | (audio->frame_sound_length << 1) | (audio->frame_freq_sweep << 2));
+    put_u8(w, audio->div_apu);
+    put_u64(w, audio->synced_clocks);
+    put_bytes(w, audio->waveforms, sizeof(audio->waveforms));
+
+    /* the steps still being spread over the next samples, the audio after a load is the same */
+    for (int c = 0; c < 2; c++) {
+        put_u32(w, audio->levels[c]);
+        put_u32(w, audio->blep_integrator[c]);
+        for (int i = 0; i < AUDIO_BLEP_BUFFER; i++)
+            put_u32(w, audio->blep_buffer[c][i]);
+    }
+    put_u8(w, audio->blep_pos);
+}
+
+static void
+load_apu(state_reader_t *r, gbc_t *gbc)
+{
+    gbc_audio_t *audio = &gbc->audio;
+
+    audio->cycles = get_u64(r);
+    load_channel(r, &audio->c1, 0);
+    load_channel(r, &audio->c2, 0);
+    load_channel(r, &audio->c3, 0);
+    load_channel(r, &audio->c4, 1);
+    audio->NR52 = get_u8(r);
+    audio->NR51 = get_u8(r);
+    audio->NR50 = get_u8(r);
+    audio->output_sample_cycles_remainder = get_u32(r);
+    audio->output_sample_cycles = get_u16(r);
+    audio->sample_divider = (int16_t)get_u16(r);
+    audio->m_cycles = get_u8(r);
+    audio->frame_sequencer = get_u8(r);
+    uint8_t flags = get_u8(r);
+    audio->frame_envelope_sweep = flags & 1;
+    audio->frame_sound_length = (flags >> 1) & 1;
+    audio->frame_freq_sweep = (flags >> 2) & 1;
+    audio->div_apu = get_u8(r);
+    audio->synced_clocks = get_u64(r);
+    /* worked out again from DIV when the next frame starts */
+    audio->frame_sequencer_clocks = AUDIO_FRAME_SEQUENCER_UNKNOWN;
+    get_bytes(r, audio->waveforms, sizeof(audio->waveforms));
+
+    for (int c = 0; c < 2; c++) {
+        audio->levels[c] = (int32_t)get_u32(r);
+        audio->blep_integrator[c] = (int32_t)get_u32(r);
+        for (int i = 0; i < AUDIO_BLEP_BUFFER; i++)
+            audio->blep_buffer[c][i] = (int32_t)get_u32(r);
+    }
+    audio->blep_pos = get_u8(r) & (AUDIO_BLEP_BUFFER - 1);
+}
+
+static void
+save_mbc(state_writer_t *w, gbc_t *gbc)
+{
+    gbc_mbc_t *mbc = &gbc->mbc;
+
+    put_u16(w, mbc->rom_bank);
+    put_u8(w, mbc->ram_bank);
+    put_u8(w, mbc->ram_enabled);
+    put_u8(w, mbc->mode);
+    /* only the banks the cartridge has */
+    put_bytes(w, mbc->ram_banks, mbc->ram_size);
+
+    put_bytes(w, mbc->rtc.regs, MBC3_RTC_REGS);
+    put_bytes(w, mbc->rtc.latched, MBC3_RTC_REGS);
+    put_u8(w, mbc->rtc.latch);
+    put_u64(w, mbc->rtc.clocks);
+    put_u32(w, mbc->rtc.sub);
+}
+
+static void
+load_mbc(state_reader_t *r, gbc_t *gbc)
+{
+    gbc_mbc_t *mbc = &gbc->mbc;
+
+    mbc->rom_bank = get_u16(r);
+    mbc->ram_bank = get_u8(r);
+    mbc->ram_enabled = get_u8(r);
+    mbc->mode = get_u8(r);
+
+    /* page by page, only the pages that change have to be written back to the .sav */
+    uint8_t page[MEMORY_PAGE_SIZE];
+    for (uint32_t offset = 0; offset < mbc->ram_size; offset += MEMORY_PAGE_SIZE) {
+        get_bytes(r, page, MEMORY_PAGE_SIZE);
+        if (memcmp(mbc->ram_banks + offset, page, MEMORY_PAGE_SIZE) != 0) {
+            memcpy(mbc->ram_banks + offset, page, MEMORY_PAGE_SIZE);
+            gbc_mbc_mark_ram(mbc, offset);
+        }
+    }
+
+    get_bytes(r, mbc->rtc.regs, MBC3_RTC_REGS);
+    get_bytes(r, mbc->rtc.latched, MBC3_RTC_REGS);
+    mbc->rtc.latch = get_u8(r);
+    mbc->rtc.clocks = get_u64(r);
+    mbc->rtc.sub = get_u32(r);
+}
+
+static void
+save_sched(state_writer_t *w, gbc_t *gbc)
+{
+    gbc_scheduler_t *sched = &gbc->sched;
+
+    put_u64(w, sched->cycles);
+    put_u64(w, sched->clocks);
+    put_u64(w, sched->base_cycles);
+    put_u64(w, sched->base_clocks);
+    put_u8(w, sched->dspeed);
+}
+
+static void
+load_sched(state_reader_t *r, gbc_t *gbc)
+{
+    gbc_scheduler_t *sched = &gbc->sched;
+
+    sched->cycles = get_u64(r);
+    sched->clocks = get_u64(r);
+    sched->base_cycles = get_u64(r);
+    sched->base_clocks = get_u64(r);
+    sched->dspeed = get_u8(r);
+    /* the events are rebuilt when the next frame starts */
+    sched->count = 0;
+    sched->dirty = 0;
+}
+
+typedef struct state_section state_section_t;
+
+struct state_section
+{
+    const char *tag;
+    void (*save)(state_writer_t *w, gbc_t *gbc);
+    void (*load)(state_reader_t *r, gbc_t *gbc);
+};
+
+static const state_section_t _sections[] = {
+    { STATE_TAG_CPU, save_cpu, load_cpu },
+    { STATE_TAG_MEM, save_mem, load_mem },
+    { STATE_TAG_PPU, save_ppu, load_ppu },
+    { STATE_TAG_TIMER, save_timer, load_timer },
+    { STATE_TAG_APU, save_apu, load_apu },
+    { STATE_TAG_MBC, save_mbc, load_mbc },
+    { STATE_TAG_SCHED, save_sched, load_sched },
+};
+
+#define STATE_SECTIONS (sizeof(_sections) / sizeof(_sections[0]))
+
+static size_t
+section_size(const state_section_t *section, gbc_t *gbc)
+{
+    state_writer_t counter = { NULL, 0, 0 };
+    section->save(&counter, gbc);
+    return counter.pos;
+}
+
+size_t
+gbc_state_size(gbc_t *gbc)
+{
+    size_t size = 4 + 2 + STATE_CART_ID_SIZE;
+
+    for (size_t i = 0; i < STATE_SECTIONS; i++)
+        size += STATE_SECTION_HEADER_SIZE + section_size(&_sections[i], gbc);
+
+    return size;
+}
+
+size_t
+gbc_state_save(gbc_t *gbc, uint8_t *buf, size_t size)
+{
+    state_writer_t w = { buf, size, 0 };
+    uint8_t id[STATE_CART_ID_SIZE];
+
+    if (size < gbc_state_size(gbc))
+        return 0;
+
+    put_bytes(&w, GBC_STATE_MAGIC, 4);
+    put_u16(&w, GBC_STATE_VERSION);
+    cart_id(gbc, id);
+    put_bytes(&w, id, STATE_CART_ID_SIZE);
+
+    for (size_t i = 0; i < STATE_SECTIONS; i++) {
+        const state_section_t *section = &_sections[i];
+        put_bytes(&w, section->tag, 4);
+        size_t length_pos = w.pos;
+        put_u32(&w, 0);
+
+        section->save(&w, gbc);
+
+        /* patch the length in */
+        state_writer_t patch = { buf, size, length_pos };
+        put_u32(&patch, w.pos - length_pos - 4);
+    }
+
+    return w.pos;
+}
+
+int
+gbc_state_load(gbc_t *gbc, const uint8_t *buf, size_t size)
+{
+    state_reader_t r = { buf, size, 0 };
+    uint8_t magic[4], id[STATE_CART_ID_SIZE], state_id[STATE_CART_ID_SIZE];
+
+    get_bytes(&r, magic, 4);
+    if (memcmp(magic, GBC_STATE_MAGIC, 4) != 0) {
+        LOG_ERROR("[STATE] Not a save state\n");
+        return 1;
+    }
+
+    uint16_t version = get_u16(&r);
+    if (version != GBC_STATE_VERSION) {
+        LOG_ERROR("[STATE] Unsupported save state version %d\n", version);
+        return 1;
+    }
+
+    cart_id(gbc, id);
+    get_bytes(&r, state_id, STATE_CART_ID_SIZE);
+    if (memcmp(id, state_id, STATE_CART_ID_SIZE) != 0) {
+        LOG_ERROR("[STATE] The save state belongs to another cartridge\n");
+        return 1;
+    }
+
+    /* check every section before touching anything */
+    size_t begin = r.pos;
+    for (size_t i = 0; i < STATE_SECTIONS; i++) {
+        const state_section_t *section = &_sections[i];
+        uint8_t tag[4];
+
+        get_bytes(&r, tag, 4);
+        uint32_t length = get_u32(&r);
+        if (memcmp(tag, section->tag, 4) != 0 || length != section_size(section, gbc) ||
+            r.pos + length > size) {
+            LOG_ERROR("[STATE] Corrupted section %.4s\n", section->tag);
+            return 1;
+        }
+        r.pos += length;
+    }
+
+    r.pos = begin;
+    for (size_t i = 0; i < STATE_SECTIONS; i++) {
+        r.pos += STATE_SECTION_HEADER_SIZE;
+        _sections[i].load(&r, gbc);
+    }
+
+    /* nothing that was derived from the old memory is valid */
+    memset(gbc->mem.wram_code, 0, sizeof(gbc->mem.wram_code));
+    gbc_block_cache_flush(gbc->cpu.blocks);
+    remap_memory(&gbc->mem);
+
+    return 0;
+}
+
+int
+gbc_state_save_file(gbc_t *gbc, const char *path)
+{
+    size_t size = gbc_state_size(gbc);
+    uint8_t *buf = (uint8_t*)malloc_memory(size);
+    if (!buf) {
+        LOG_ERROR("[STATE] Failed to allocate memory\n");
+        return 1;
+    }
+
+    size = gbc_state_save(gbc, buf, size);
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        LOG_ERROR("[STATE] Failed to open %s\n", path);
+        free_memory(buf);
+        return 1;
+    }
+
+    size_t n = fwrite(buf, 1, size, f);
+    fclose(f);
+    free_memory(buf);
+
+    return n == size ? 0 : 1;
+}
+
+int
+gbc_state_load_file(gbc_t *gbc, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        LOG_ERROR("[STATE] Failed to open %s\n", path);
+        return 1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    rewind(f);
+
+    uint8_t *buf = (uint8_t*)malloc_memory(size);
+    if (!buf) {
+        LOG_ERROR("[STATE] Failed to allocate memory\n");
+        fclose(f);
+        return 1;
+    }
+
+    size_t n = fread(buf, 1, size, f);
+    fclose(f);
+
+    int ret = n == size ? gbc_state_load(gbc, buf, size) : 1;
+    free_memory(buf);
+    return ret;
+}
@@ -0,0 +1,32 @@
+#ifndef _STATE_H
+#define _STATE_H
+
+#include "gbc.h"
+
+/*
+  Save states.
+  A state is a small header followed by one tagged section per component, every
+  value is stored little endian field by field, so the states do not depend on
+  the struct layout and never contain host pointers. A state can only be loaded
+  into a gbc_t initialized with the same cartridge, the pointers are kept and
+  the memory map is rebuilt from the restored banking registers.
+
+  It should only be taken or loaded between frames (e.g. in screen_update).
+  The frame buffers are output, not state, lines the ppu has not redrawn since
+  the load still show the old frame.
+*/
+
+#define GBC_STATE_MAGIC     "KGBS"
+#define GBC_STATE_VERSION   4
+
+/* bytes a state of this gbc_t needs at most */
+size_t gbc_state_size(gbc_t *gbc);
+/* returns the bytes written, 0 if the buffer is too small */
+size_t gbc_state_save(gbc_t *gbc, uint8_t *buf, size_t size);
+/* returns 0 on success, the gbc_t is left untouched if the state is invalid */
+int gbc_state_load(gbc_t *gbc, const uint8_t *buf, size_t size);
+
+int gbc_state_save_file(gbc_t *gbc, const char *path);
+int gbc_state_load_file(gbc_t *gbc, const char *path);
+
+#endif
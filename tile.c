@@ -0,0 +1,138 @@
+#include "tile.h"
+#include "common.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define TILE_X86
+#include <immintrin.h>
+#endif
+
+/*
+  scalar: every byte of _tile_spread[b] is one bit of b, leftmost pixel first,
+  so a row is spread[lo] | spread[hi] << 1, 8 pixels at once
+*/
+#define TILE_BIT(b, bit, pixel) ((uint64_t)((b) >> (bit) & 1) << ((pixel) * 8))
+#define TILE_SPREAD(b) (TILE_BIT(b, 7, 0) | TILE_BIT(b, 6, 1) | TILE_BIT(b, 5, 2) | TILE_BIT(b, 4, 3) | \
+    TILE_BIT(b, 3, 4) | TILE_BIT(b, 2, 5) | TILE_BIT(b, 1, 6) | TILE_BIT(b, 0, 7))
+#define TILE_SPREAD_XFLIP(b) (TILE_BIT(b, 0, 0) | TILE_BIT(b, 1, 1) | TILE_BIT(b, 2, 2) | TILE_BIT(b, 3, 3) | \
+    TILE_BIT(b, 4, 4) | TILE_BIT(b, 5, 5) | TILE_BIT(b, 6, 6) | TILE_BIT(b, 7, 7))
+#define TILE_SPREAD4(f, b) f(b), f(b + 1), f(b + 2), f(b + 3)
+#define TILE_SPREAD16(f, b) TILE_SPREAD4(f, b), TILE_SPREAD4(f, b + 4), TILE_SPREAD4(f, b + 8), TILE_SPREAD4(f, b + 12)
+#define TILE_SPREAD64(f, b) TILE_SPREAD16(f, b), TILE_SPREAD16(f, b + 16), TILE_SPREAD16(f, b + 32), TILE_SPREAD16(f, b + 48)
+#define TILE_SPREAD256(f) TILE_SPREAD64(f, 0), TILE_SPREAD64(f, 64), TILE_SPREAD64(f, 128), TILE_SPREAD64(f, 192)
+
+static const uint64_t _tile_spread[2][256] = {
+    { TILE_SPREAD256(TILE_SPREAD) },
+    { TILE_SPREAD256(TILE_SPREAD_XFLIP) },
+};
+
+static void
+tile_decode_row_scalar(uint8_t lo, uint8_t hi, uint8_t xflip, uint8_t *ids)
+{
+    const uint64_t *spread = _tile_spread[xflip ? 1 : 0];
+    uint64_t row = spread[lo] | (spread[hi] << 1);
+    /* pixel i is byte i of the value whatever the byte order */
+    for (int i = 0; i < 8; i++)
+        ids[i] = (uint8_t)(row >> (i * 8));
+}
+
+static void
+tile_expand_row_scalar(uint8_t lo, uint8_t hi, uint8_t xflip, const uint16_t *palette, uint16_t *colors, uint8_t *ids)
+{
+    tile_decode_row_scalar(lo, hi, xflip, ids);
+    for (int i = 0; i < 8; i++)
+        colors[i] = palette[ids[i]];
+}
+
+static void
+tile_expand_row_rgba_scalar(uint8_t lo, uint8_t hi, uint8_t xflip, const uint32_t *palette, uint32_t *colors)
+{
+    uint8_t ids[8];
+    tile_decode_row_scalar(lo, hi, xflip, ids);
+    for (int i = 0; i < 8; i++)
+        colors[i] = palette[ids[i]];
+}
+
+gbc_tile_expand_func gbc_tile_expand_row = tile_expand_row_scalar;
+gbc_tile_expand_rgba_func gbc_tile_expand_row_rgba = tile_expand_row_rgba_scalar;
+
+#ifdef TILE_X86
+
+/*
+  SIMD: every lane tests one bit of the broadcasted bitplanes, giving an all-ones
+  mask per plane, the palette lookup is then two levels of mask blends,
+  there are only 4 colors.
+*/
+
+__attribute__((target("sse2"))) static inline __m128i
+tile_blend_sse2(__m128i mask, __m128i a, __m128i b)
+{
+    /* mask ? b : a */
+    return _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+}
+
+__attribute__((target("sse2"))) static void
+tile_expand_row_sse2(uint8_t lo, uint8_t hi, uint8_t xflip, const uint16_t *palette, uint16_t *colors, uint8_t *ids)
+{
+    __m128i bits = xflip ?
+        _mm_set_epi16(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01) :
+        _mm_set_epi16(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+    __m128i l = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(lo), bits), bits);
+    __m128i h = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(hi), bits), bits);
+    __m128i c01 = tile_blend_sse2(l, _mm_set1_epi16(palette[0]), _mm_set1_epi16(palette[1]));
+    __m128i c23 = tile_blend_sse2(l, _mm_set1_epi16(palette[2]), _mm_set1_epi16(palette[3]));
+    _mm_storeu_si128((__m128i*)colors, tile_blend_sse2(h, c01, c23));
+
+    __m128i row = _mm_or_si128(_mm_and_si128(l, _mm_set1_epi16(1)), _mm_and_si128(h, _mm_set1_epi16(2)));
+    _mm_storel_epi64((__m128i*)ids, _mm_packus_epi16(row, _mm_setzero_si128()));
+}
+
+__attribute__((target("sse2"))) static void
+tile_expand_row_rgba_sse2(uint8_t lo, uint8_t hi, uint8_t xflip, const uint32_t *palette, uint32_t *colors)
+{
+    __m128i p0 = _mm_set1_epi32(palette[0]), p1 = _mm_set1_epi32(palette[1]);
+    __m128i p2 = _mm_set1_epi32(palette[2]), p3 = _mm_set1_epi32(palette[3]);
+    __m128i l4 = _mm_set1_epi32(lo), h4 = _mm_set1_epi32(hi);
+
+    /* 4 pixels at a time */
+    for (int half = 0; half < 2; half++) {
+        __m128i bits;
+        if (xflip)
+            bits = half ? _mm_set_epi32(0x80, 0x40, 0x20, 0x10) : _mm_set_epi32(0x08, 0x04, 0x02, 0x01);
+        else
+            bits = half ? _mm_set_epi32(0x01, 0x02, 0x04, 0x08) : _mm_set_epi32(0x10, 0x20, 0x40, 0x80);
+        __m128i l = _mm_cmpeq_epi32(_mm_and_si128(l4, bits), bits);
+        __m128i h = _mm_cmpeq_epi32(_mm_and_si128(h4, bits), bits);
+        __m128i c = tile_blend_sse2(h, tile_blend_sse2(l, p0, p1), tile_blend_sse2(l, p2, p3));
+        _mm_storeu_si128((__m128i*)(colors + half * 4), c);
+    }
+}
+
+__attribute__((target("avx2"))) static void
+tile_expand_row_rgba_avx2(uint8_t lo, uint8_t hi, uint8_t xflip, const uint32_t *palette, uint32_t *colors)
+{
+    __m256i bits = xflip ?
+        _mm256_set_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01) :
+        _mm256_set_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+    __m256i l = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(lo), bits), bits);
+    __m256i h = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(hi), bits), bits);
+    __m256i c01 = _mm256_blendv_epi8(_mm256_set1_epi32(palette[0]), _mm256_set1_epi32(palette[1]), l);
+    __m256i c23 = _mm256_blendv_epi8(_mm256_set1_epi32(palette[2]), _mm256_set1_epi32(palette[3]), l);
+    _mm256_storeu_si256((__m256i*)colors, _mm256_blendv_epi8(c01, c23, h));
+}
+
+/* runs once before main, so no instance ever sees the pointers change */
+__attribute__((constructor)) static void
+tile_select_kernels()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        gbc_tile_expand_row = tile_expand_row_sse2;
+        gbc_tile_expand_row_rgba = tile_expand_row_rgba_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        /* 8 x 32 bit fill a register, the 16 bit rows already fit in SSE2 */
+        gbc_tile_expand_row_rgba = tile_expand_row_rgba_avx2;
+    }
+}
+
+#endif
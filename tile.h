@@ -0,0 +1,27 @@
+#ifndef _TILE_H
+#define _TILE_H
+
+#include <stdint.h>
+
+/*
+  2bpp tile row kernels shared by the ppu and the tile viewer.
+  A tile row is 2 bytes, lo holds bit 0 and hi holds bit 1 of the color ids,
+  the leftmost pixel is bit 7. The outputs are always 8 pixels, left to right,
+  xflip mirrors the row.
+
+  There are SSE2/AVX2 versions on x86, the best one the cpu supports is picked
+  once at startup, before main, everything else uses the scalar ones.
+*/
+
+typedef void (*gbc_tile_expand_func)(uint8_t lo, uint8_t hi, uint8_t xflip, const uint16_t *palette, uint16_t *colors, uint8_t *ids);
+typedef void (*gbc_tile_expand_rgba_func)(uint8_t lo, uint8_t hi, uint8_t xflip, const uint32_t *palette, uint32_t *colors);
+
+/*
+  colors of the row through a 4 color palette, e.g. a CGB palette (RGB555),
+  and their color ids (0-3) from the same decode
+*/
+extern gbc_tile_expand_func gbc_tile_expand_row;
+/* colors only, with 32 bit colors (RGBA8888) */
+extern gbc_tile_expand_rgba_func gbc_tile_expand_row_rgba;
+
+#endif
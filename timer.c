@@ -1,7 +1,7 @@
 #include "timer.h"
 #include "cpu.h"
 
-static uint16_t _timer_mode_cycles[] = {
+static const uint16_t _timer_mode_cycles[] = {
     TAC_TIMER_SPEED_MODE_0_CYCLES,
     TAC_TIMER_SPEED_MODE_1_CYCLES,
     TAC_TIMER_SPEED_MODE_2_CYCLES,
@@ -54,5 +54,55 @@ void gbc_timer_cycle(gbc_timer_t *timer)
         }
         IO_PORT_WRITE(timer->mem, IO_PORT_TIMA, tima);
     }
+}
+
+/* cycles until the next TIMA increment, timer_cycles only matches the period on the way up */
+static uint32_t
+timer_next_tick(gbc_timer_t *timer)
+{
+    uint16_t cycles = _timer_mode_cycles[*timer->tacp & TAC_TIMER_SPEED_MASK];
+    return (uint16_t)(cycles - timer->timer_cycles - 1) + 1;
+}
+
+/* same as calling gbc_timer_cycle n times */
+void
+gbc_timer_run_cycles(gbc_timer_t *timer, uint64_t n)
+{
+    uint64_t div_cycles = timer->div_cycles + n;
+    *timer->divp += div_cycles / TICK_DIVIDER;
+    timer->div_cycles = div_cycles % TICK_DIVIDER;
+
+    if (!(*timer->tacp & TAC_TIMER_ENABLE)) {
+        return;
+    }
+
+    uint16_t cycles = _timer_mode_cycles[*timer->tacp & TAC_TIMER_SPEED_MASK];
+    uint64_t next = timer_next_tick(timer);
+
+    while (n >= next) {
+        n -= next;
+        next = cycles;
+        timer->timer_cycles = 0;
 
-}
\ No newline at end of file
+        uint16_t tima = *timer->timap + 1;
+        if (tima > 0xFF) {
+            *timer->timap = *timer->tmap;
+            REQUEST_INTERRUPT(timer->mem, INTERRUPT_TIMER);
+        }
+        IO_PORT_WRITE(timer->mem, IO_PORT_TIMA, tima);
+    }
+
+    timer->timer_cycles += n;
+}
+
+/* cycles until TIMA overflows and requests an interrupt */
+uint64_t
+gbc_timer_next_overflow(gbc_timer_t *timer)
+{
+    if (!(*timer->tacp & TAC_TIMER_ENABLE)) {
+        return UINT64_MAX;
+    }
+
+    uint16_t cycles = _timer_mode_cycles[*timer->tacp & TAC_TIMER_SPEED_MASK];
+    return timer_next_tick(timer) + (uint64_t)(0xFF - *timer->timap) * cycles;
+}
@@ -36,5 +36,7 @@ struct gbc_timer
 void gbc_timer_init(gbc_timer_t *timer);
 void gbc_timer_connect(gbc_timer_t *timer, gbc_memory_t *mem);
 void gbc_timer_cycle(gbc_timer_t *timer);
+void gbc_timer_run_cycles(gbc_timer_t *timer, uint64_t n);
+uint64_t gbc_timer_next_overflow(gbc_timer_t *timer);
 
 #endif
\ No newline at end of file
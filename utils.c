@@ -1,10 +1,25 @@
 /* TODO: cross-platform  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
 #include "utils.h"
 #include <stdlib.h>
 
+#if !defined(_WIN32)
+#define HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if !defined(GBC_NO_THREADS) && defined(_WIN32)
+#include <windows.h>
+#endif
+
 void* 
 malloc_memory(size_t size)
 {
@@ -17,10 +32,206 @@ free_memory(void *ptr)
     free(ptr);        
 }
 
+static int
+read_file(mapped_file_t *file, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return 1;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+
+    file->data = size > 0 ? (uint8_t*)malloc_memory(size) : NULL;
+    if (!file->data) {
+        fclose(f);
+        return 1;
+    }
+
+    file->size = fread(file->data, 1, size, f);
+    file->mapped = 0;
+    fclose(f);
+
+    if (file->size != (size_t)size) {
+        free_memory(file->data);
+        file->data = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+int
+map_file(mapped_file_t *file, const char *path)
+{
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+
+#ifdef HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            file->data = (uint8_t*)data;
+            file->size = st.st_size;
+            file->mapped = 1;
+        }
+    }
+    /* the mapping stays valid after the close */
+    close(fd);
+
+    if (file->mapped)
+        return 0;
+#endif
+
+    return read_file(file, path);
+}
+
+int
+map_file_shared(mapped_file_t *file, const char *path, size_t size)
+{
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+
+    if (size == 0)
+        return 1;
+
+#ifdef HAVE_MMAP
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (st.st_size >= (off_t)size || ftruncate(fd, size) == 0)) {
+        void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+            file->data = (uint8_t*)data;
+            file->size = size;
+            file->mapped = 1;
+        }
+    }
+    close(fd);
+
+    if (file->mapped)
+        return 0;
+#endif
+
+    file->data = (uint8_t*)malloc_memory(size);
+    if (!file->data)
+        return 1;
+    memset(file->data, 0, size);
+    file->size = size;
+
+    /* a missing file is fine, it is written by the first sync_file */
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        size_t n = fread(file->data, 1, size, f);
+        (void)n;
+        fclose(f);
+    }
+    return 0;
+}
+
+int
+sync_file(mapped_file_t *file, const char *path, size_t offset, size_t size)
+{
+    if (!file->data || offset >= file->size)
+        return 1;
+    if (size > file->size - offset)
+        size = file->size - offset;
+
+#ifdef HAVE_MMAP
+    if (file->mapped) {
+        /* msync wants the start aligned to the host pages */
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = offset & ~(page - 1);
+        return msync(file->data + begin, offset + size - begin, MS_SYNC) == 0 ? 0 : 1;
+    }
+#endif
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return 1;
+    size_t n = fwrite(file->data, 1, file->size, f);
+    fclose(f);
+    return n == file->size ? 0 : 1;
+}
+
+void
+unmap_file(mapped_file_t *file)
+{
+    if (!file->data)
+        return;
+
+#ifdef HAVE_MMAP
+    if (file->mapped)
+        munmap(file->data, file->size);
+    else
+        free_memory(file->data);
+#else
+    free_memory(file->data);
+#endif
+
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+}
+
 uint64_t
 get_time()
 {
     struct timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return ts.tv_sec * 1000000000 + ts.tv_nsec;
-}
\ No newline at end of file
+}
+
+void
+sleep_until(uint64_t time)
+{
+    struct timespec ts;
+#if defined(__linux__)
+    ts.tv_sec = time / 1000000000;
+    ts.tv_nsec = time % 1000000000;
+    /* the deadline is absolute, only a signal needs a retry */
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#else
+    /* no clock_nanosleep on macOS, a relative sleep is close enough */
+    uint64_t now = get_time();
+    if (time <= now)
+        return;
+    ts.tv_sec = (time - now) / 1000000000;
+    ts.tv_nsec = (time - now) % 1000000000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+void
+lock_mutex(gbc_mutex_t *mutex)
+{
+#if defined(GBC_NO_THREADS)
+    (void)mutex;
+#elif defined(_WIN32)
+    AcquireSRWLockExclusive((PSRWLOCK)mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void
+unlock_mutex(gbc_mutex_t *mutex)
+{
+#if defined(GBC_NO_THREADS)
+    (void)mutex;
+#elif defined(_WIN32)
+    ReleaseSRWLockExclusive((PSRWLOCK)mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
@@ -2,14 +2,63 @@
 #define _UTILS_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 void *malloc_memory(size_t size);
 void free_memory(void *ptr);
 
+typedef struct mapped_file mapped_file_t;
+
+struct mapped_file
+{
+    uint8_t *data;
+    size_t size;
+    uint8_t mapped;     /* mmap'ed, otherwise malloc'ed */
+};
+
+/*
+    Maps a file read only with MAP_PRIVATE, the pages are loaded lazily and shared with
+    every other process mapping the same file. Falls back to reading the whole file into
+    memory when mmap is not available or fails. The data must not be written.
+*/
+int map_file(mapped_file_t *file, const char *path);
+void unmap_file(mapped_file_t *file);
+
+/*
+    Maps the first size bytes of a file read/write with MAP_SHARED, the file is created or
+    grown (with zeros) when it is smaller. Without mmap it is read into memory instead.
+*/
+int map_file_shared(mapped_file_t *file, const char *path, size_t size);
+/* writes [offset, offset + size) of a map_file_shared file back to the disk (msync), the fallback writes the whole file */
+int sync_file(mapped_file_t *file, const char *path, size_t offset, size_t size);
+
 /* 
     Return the time in nanoseconds, it neither represents the current time nor the time since the program started,
     should only be used to measure the interval.
 */
 uint64_t get_time(); 
 
+/* sleeps until get_time() reaches the given time */
+void sleep_until(uint64_t time);
+
+/*
+    A lock that can be initialized statically with GBC_MUTEX_INITIALIZER, a pthread mutex,
+    an SRW lock on Windows, or nothing at all with GBC_NO_THREADS (single threaded or
+    bare-metal builds).
+*/
+#if defined(GBC_NO_THREADS)
+typedef uint8_t gbc_mutex_t;
+#define GBC_MUTEX_INITIALIZER 0
+#elif defined(_WIN32)
+typedef void *gbc_mutex_t;      /* an SRWLOCK is a single pointer, windows.h stays out of the header */
+#define GBC_MUTEX_INITIALIZER NULL
+#else
+#include <pthread.h>
+typedef pthread_mutex_t gbc_mutex_t;
+#define GBC_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#endif
+
+void lock_mutex(gbc_mutex_t *mutex);
+void unlock_mutex(gbc_mutex_t *mutex);
+
 #endif